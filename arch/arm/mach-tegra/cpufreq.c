@@ -36,6 +36,13 @@
 #include <linux/suspend.h>
 #include <linux/reboot.h>
 #include <linux/delay.h>
+#include <linux/input.h>
+#include <linux/kernel_stat.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/tick.h>
 
 #include <asm/system.h>
 #include <asm/smp_twd.h>
@@ -58,9 +65,85 @@ static DEFINE_MUTEX(init_mutex);
 #ifdef CONFIG_HOTPLUG_CPU
 static int disable_hotplug = 0;
 extern atomic_t hotplug_policy;
+static atomic_t hotplug_ups = ATOMIC_INIT(0);
+static atomic_t hotplug_downs = ATOMIC_INIT(0);
 #endif
 static void tegra_cpufreq_hotplug(NvRmPmRequest req);
 
+/*
+ * Load-tracking mode. When load_mode is set, the CPU envelope is pinned
+ * to a frequency picked from per-CPU busy time sampled every sample_ms,
+ * the second core is hot-plugged from the average run-queue depth and
+ * input events raise the CPU to at least boost_khz for boost_ms. NvRm DFS
+ * keeps running underneath to scale voltage and the other clock domains,
+ * but its CPU hot-plug requests are ignored. Time-in-state and transition
+ * latency are accounted in both modes, so the two can be compared on the
+ * same workload; the counters restart whenever the mode changes.
+ */
+static DEFINE_MUTEX(gov_mutex);
+static struct workqueue_struct *gov_wq;
+static struct delayed_work gov_work;
+static bool gov_running;
+
+static int load_mode;
+static unsigned int sample_ms = 20;
+module_param(sample_ms, uint, 0644);
+static unsigned int up_load = 80;
+module_param(up_load, uint, 0644);
+static unsigned int down_delay_ms = 80;
+module_param(down_delay_ms, uint, 0644);
+static unsigned int boost_khz = 760000;
+module_param(boost_khz, uint, 0644);
+static unsigned int boost_ms = 200;
+module_param(boost_ms, uint, 0644);
+/* run-queue depth thresholds are in hundredths of a runnable task */
+static unsigned int hotplug_up_rq = 180;
+module_param(hotplug_up_rq, uint, 0644);
+static unsigned int hotplug_down_rq = 110;
+module_param(hotplug_down_rq, uint, 0644);
+static unsigned int hotplug_up_samples = 3;
+module_param(hotplug_up_samples, uint, 0644);
+static unsigned int hotplug_down_samples = 25;
+module_param(hotplug_down_samples, uint, 0644);
+
+static unsigned int policy_min;
+static unsigned int policy_max;
+static unsigned int gov_target;
+static ktime_t gov_target_time;
+static unsigned int rq_avg;
+static unsigned int hp_up_count;
+static unsigned int hp_down_count;
+static unsigned long boost_until = INITIAL_JIFFIES;
+
+struct tegra_cpu_load {
+	u64 idle_us;
+	u64 wall_us;
+	bool valid;
+};
+static DEFINE_PER_CPU(struct tegra_cpu_load, cpu_load);
+
+#define TEGRA_CPUFREQ_STATES	16
+/* a requested transition not seen within this long is counted as missed */
+#define TEGRA_CPUFREQ_LAT_TIMEOUT_US	500000
+
+static struct {
+	struct {
+		unsigned int khz;
+		u64 time_us;
+	} state[TEGRA_CPUFREQ_STATES];
+	unsigned int nr_states;
+	unsigned int cur_khz;
+	ktime_t last;
+	unsigned long transitions;
+	bool req_pending;
+	ktime_t req_time;
+	u64 lat_total_us;
+	unsigned int lat_count;
+	unsigned int lat_max_us;
+	unsigned int lat_missed;
+	unsigned long boosts;
+} stats;
+
 void pmu_tegra_cpufreq_hotplug(bool onoff)
 {
 	if(onoff == 1) {
@@ -107,14 +190,20 @@ static void tegra_cpufreq_hotplug(NvRmPmRequest req)
 		cpumask_andnot(&m, cpu_present_mask, cpu_online_mask);
 		cpu = cpumask_any(&m);
 
-		if (cpu_present(cpu) && !cpu_online(cpu))
+		if (cpu_present(cpu) && !cpu_online(cpu)) {
 			rc = cpu_up(cpu);
+			if (!rc)
+				atomic_inc(&hotplug_ups);
+		}
 
 	} else if (req & NvRmPmRequest_CpuOffFlag && (policy < NR_CPUS || !policy)) {
 		cpu = cpumask_any_but(cpu_online_mask, 0);
 
-		if (cpu_present(cpu) && cpu_online(cpu))
+		if (cpu_present(cpu) && cpu_online(cpu)) {
 			rc = cpu_down(cpu);
+			if (!rc)
+				atomic_inc(&hotplug_downs);
+		}
 	}
 #endif
 	if (rc)
@@ -185,7 +274,8 @@ static int tegra_cpufreq_dfsd(void *arg)
 		if (try_to_freeze())
 			continue;
 
-		tegra_cpufreq_hotplug(req);
+		if (!load_mode)
+			tegra_cpufreq_hotplug(req);
 
 #ifdef CONFIG_USE_ARM_TWD_PRESCALER
 		rate = clk_get_rate(clk_cpu);
@@ -202,6 +292,369 @@ static int tegra_cpufreq_dfsd(void *arg)
 	return 0;
 }
 
+/* must be called with gov_mutex held */
+static void tegra_cpufreq_stats_reset(void)
+{
+	memset(stats.state, 0, sizeof(stats.state));
+	stats.nr_states = 0;
+	stats.last = ktime_get();
+	stats.transitions = 0;
+	stats.req_pending = false;
+	stats.lat_total_us = 0;
+	stats.lat_count = 0;
+	stats.lat_max_us = 0;
+	stats.lat_missed = 0;
+	stats.boosts = 0;
+}
+
+static void tegra_cpufreq_stats_add(unsigned int khz, u64 us)
+{
+	unsigned int i;
+
+	for (i = 0; i < stats.nr_states; i++) {
+		if (stats.state[i].khz == khz)
+			goto found;
+		if (stats.state[i].khz > khz)
+			break;
+	}
+
+	/* kept sorted; once full, unseen rates go to the next state up */
+	if (stats.nr_states == TEGRA_CPUFREQ_STATES) {
+		i = min(i, stats.nr_states - 1);
+		goto found;
+	}
+	memmove(&stats.state[i + 1], &stats.state[i],
+		(stats.nr_states - i) * sizeof(stats.state[0]));
+	stats.state[i].khz = khz;
+	stats.state[i].time_us = 0;
+	stats.nr_states++;
+found:
+	stats.state[i].time_us += us;
+}
+
+/*
+ * Samples the CPU clock and charges the time since the last sample to the
+ * rate seen then; the first change after a pinned request completes that
+ * request's transition latency. Resolution is therefore sample_ms. Must be
+ * called with gov_mutex held.
+ */
+static unsigned int tegra_cpufreq_account(void)
+{
+	unsigned int khz = clk_get_rate(clk_cpu) / 1000;
+	ktime_t now = ktime_get();
+	u64 us;
+
+	if (stats.cur_khz) {
+		us = ktime_to_us(ktime_sub(now, stats.last));
+		tegra_cpufreq_stats_add(stats.cur_khz, us);
+	}
+
+	if (stats.req_pending) {
+		us = ktime_to_us(ktime_sub(now, stats.req_time));
+		if (khz != stats.cur_khz) {
+			stats.lat_total_us += us;
+			stats.lat_count++;
+			stats.lat_max_us = max_t(unsigned int, stats.lat_max_us, us);
+			stats.req_pending = false;
+		} else if (us > TEGRA_CPUFREQ_LAT_TIMEOUT_US) {
+			stats.lat_missed++;
+			stats.req_pending = false;
+		}
+	}
+
+	if (stats.cur_khz && khz != stats.cur_khz)
+		stats.transitions++;
+	stats.cur_khz = khz;
+	stats.last = now;
+	return khz;
+}
+
+/* must be called with gov_mutex held */
+static void tegra_load_set(unsigned int khz)
+{
+	NvError e;
+
+	khz = clamp(khz, policy_min, policy_max);
+	if (khz == gov_target)
+		return;
+
+	e = NvRmDfsSetCpuEnvelope(rm_cpufreq, khz, khz);
+	if (e) {
+		pr_err("%s: error 0x%08x pinning %u kHz\n", __func__, e, khz);
+		return;
+	}
+
+	/* only time requests that should move the clock by at least 5% */
+	if (abs((int)khz - (int)stats.cur_khz) > policy_max / 20) {
+		stats.req_pending = true;
+		stats.req_time = ktime_get();
+	}
+	gov_target = khz;
+	gov_target_time = ktime_get();
+}
+
+/* returns the busy percentage of cpu since its previous sample */
+static unsigned int tegra_cpu_load(int cpu)
+{
+	struct tegra_cpu_load *l = &per_cpu(cpu_load, cpu);
+	u64 idle, wall, d_idle, d_wall;
+	unsigned int load = 0;
+
+	idle = get_cpu_idle_time_us(cpu, &wall);
+	if (idle == -1ULL) {
+		cputime64_t t = cputime64_add(kstat_cpu(cpu).cpustat.idle,
+					      kstat_cpu(cpu).cpustat.iowait);
+
+		idle = (u64)jiffies_to_usecs(1) * cputime64_to_jiffies64(t);
+		wall = (u64)jiffies_to_usecs(1) * get_jiffies_64();
+	}
+
+	if (l->valid && wall > l->wall_us) {
+		d_wall = wall - l->wall_us;
+		d_idle = min(idle - l->idle_us, d_wall);
+		load = div64_u64(100 * (d_wall - d_idle), d_wall);
+	}
+
+	l->idle_us = idle;
+	l->wall_us = wall;
+	l->valid = true;
+	return load;
+}
+
+/* a cpu's idle time does not advance while it is offline, so the sample
+ * taken before it went down would make it look fully busy afterwards */
+static int tegra_cpu_load_notify(struct notifier_block *nb,
+				 unsigned long action, void *hcpu)
+{
+	switch (action & ~CPU_TASKS_FROZEN) {
+	case CPU_ONLINE:
+	case CPU_DEAD:
+		per_cpu(cpu_load, (long)hcpu).valid = false;
+		break;
+	}
+	return NOTIFY_OK;
+}
+
+/* must be called with gov_mutex held */
+static void tegra_load_target(unsigned int load)
+{
+	unsigned int target;
+	s64 held_us;
+
+	if (load >= up_load)
+		target = policy_max;
+	else
+		target = policy_max / up_load * load;
+
+	if (boost_khz && time_before(jiffies, boost_until))
+		target = max(target, boost_khz);
+	target = clamp(target, policy_min, policy_max);
+
+	/* ignore small moves, and hold a frequency before ramping down */
+	if (target != policy_min && target != policy_max &&
+	    abs((int)target - (int)gov_target) < policy_max / 20)
+		return;
+	held_us = ktime_to_us(ktime_sub(ktime_get(), gov_target_time));
+	if (target < gov_target && held_us < down_delay_ms * USEC_PER_MSEC)
+		return;
+
+	tegra_load_set(target);
+}
+
+#ifdef CONFIG_HOTPLUG_CPU
+/*
+ * Returns NvRmPmRequest_CpuOnFlag or NvRmPmRequest_CpuOffFlag once the
+ * average run-queue depth has stayed past its threshold long enough, 0
+ * otherwise. Hot-plug is left alone while user space has pinned the number
+ * of online CPUs through sysfs. Must be called with gov_mutex held.
+ */
+static NvRmPmRequest tegra_load_hotplug(void)
+{
+	unsigned int online = num_online_cpus();
+
+	if (disable_hotplug || atomic_read(&hotplug_policy)) {
+		hp_up_count = hp_down_count = 0;
+		return 0;
+	}
+
+	if (online < num_present_cpus() && rq_avg >= hotplug_up_rq) {
+		if (++hp_up_count >= hotplug_up_samples) {
+			hp_up_count = 0;
+			return NvRmPmRequest_CpuOnFlag;
+		}
+	} else
+		hp_up_count = 0;
+
+	if (online > 1 && rq_avg < hotplug_down_rq) {
+		if (++hp_down_count >= hotplug_down_samples) {
+			hp_down_count = 0;
+			return NvRmPmRequest_CpuOffFlag;
+		}
+	} else
+		hp_down_count = 0;
+
+	return 0;
+}
+#else
+static inline NvRmPmRequest tegra_load_hotplug(void)
+{
+	return 0;
+}
+#endif
+
+static void tegra_load_sample(struct work_struct *work)
+{
+	NvRmPmRequest req = 0;
+	unsigned int load = 0;
+	unsigned long nr;
+	int cpu;
+
+	mutex_lock(&gov_mutex);
+	tegra_cpufreq_account();
+
+	for_each_online_cpu(cpu)
+		load = max(load, tegra_cpu_load(cpu));
+
+	/* nr_running() includes this worker */
+	nr = nr_running();
+	nr = nr ? nr - 1 : 0;
+	rq_avg = (rq_avg * 3 + nr * 100) / 4;
+
+	if (load_mode) {
+		tegra_load_target(load);
+		req = tegra_load_hotplug();
+	}
+	mutex_unlock(&gov_mutex);
+
+	/* cpu_up() re-enters the cpufreq driver, so call it unlocked */
+	if (req)
+		tegra_cpufreq_hotplug(req);
+
+	queue_delayed_work(gov_wq, to_delayed_work(work),
+			   msecs_to_jiffies(sample_ms));
+}
+
+static void tegra_load_boost(struct work_struct *work)
+{
+	mutex_lock(&gov_mutex);
+	if (load_mode && gov_target < boost_khz) {
+		tegra_load_set(boost_khz);
+		stats.boosts++;
+	}
+	mutex_unlock(&gov_mutex);
+}
+static DECLARE_WORK(boost_work, tegra_load_boost);
+
+static int tegra_load_mode_set(const char *arg, struct kernel_param *kp)
+{
+	int old, rc;
+
+	mutex_lock(&gov_mutex);
+	old = load_mode;
+	rc = param_set_bool(arg, kp);
+	if (!rc && gov_running && load_mode != old) {
+		if (load_mode) {
+			gov_target = 0;
+			hp_up_count = hp_down_count = 0;
+		} else {
+			NvRmDfsSetCpuEnvelope(rm_cpufreq, policy_min, policy_max);
+		}
+		tegra_cpufreq_stats_reset();
+	}
+	mutex_unlock(&gov_mutex);
+
+	return rc;
+}
+module_param_call(load_mode, tegra_load_mode_set, param_get_bool,
+		  &load_mode, 0644);
+
+static void tegra_load_start(void)
+{
+	mutex_lock(&gov_mutex);
+	if (gov_wq && !gov_running) {
+		stats.cur_khz = 0;
+		tegra_cpufreq_stats_reset();
+		queue_delayed_work(gov_wq, &gov_work,
+				   msecs_to_jiffies(sample_ms));
+		gov_running = true;
+	}
+	mutex_unlock(&gov_mutex);
+}
+
+#ifdef CONFIG_INPUT
+static void tegra_boost_event(struct input_handle *handle, unsigned int type,
+			      unsigned int code, int value)
+{
+	unsigned long was = boost_until;
+
+	if (!load_mode || !boost_khz || !gov_running)
+		return;
+
+	boost_until = jiffies + msecs_to_jiffies(boost_ms);
+	if (time_after_eq(jiffies, was))
+		queue_work(gov_wq, &boost_work);
+}
+
+static int tegra_boost_connect(struct input_handler *handler,
+			       struct input_dev *dev,
+			       const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int rc;
+
+	handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "tegra_cpufreq";
+
+	rc = input_register_handle(handle);
+	if (rc)
+		goto err_free;
+
+	rc = input_open_device(handle);
+	if (rc)
+		goto err_unregister;
+
+	return 0;
+
+err_unregister:
+	input_unregister_handle(handle);
+err_free:
+	kfree(handle);
+	return rc;
+}
+
+static void tegra_boost_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id tegra_boost_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+	},
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+	},
+	{ },
+};
+
+static struct input_handler tegra_boost_handler = {
+	.event		= tegra_boost_event,
+	.connect	= tegra_boost_connect,
+	.disconnect	= tegra_boost_disconnect,
+	.name		= "tegra_cpufreq",
+	.id_table	= tegra_boost_ids,
+};
+#endif
+
 static int tegra_verify_speed(struct cpufreq_policy *policy)
 {
 #if defined(CONFIG_USE_FAKE_SHMOO)
@@ -223,7 +676,17 @@ static unsigned int tegra_get_speed(unsigned int cpu)
 
 static int tegra_set_policy(struct cpufreq_policy *pol)
 {
-	NvError e = NvRmDfsSetCpuEnvelope(rm_cpufreq, pol->min, pol->max);
+	NvError e = NvSuccess;
+
+	mutex_lock(&gov_mutex);
+	policy_min = pol->min;
+	policy_max = pol->max;
+	if (load_mode && gov_running) {
+		if (gov_target)
+			tegra_load_set(gov_target);
+	} else
+		e = NvRmDfsSetCpuEnvelope(rm_cpufreq, pol->min, pol->max);
+	mutex_unlock(&gov_mutex);
 
 	if (e) {
 		pr_err("%s: error 0x%08x \n", __func__, e);
@@ -244,6 +707,9 @@ int tegra_start_dvfsd(void) {
 		rc = -ENOSYS;
 	mutex_unlock(&init_mutex);
 
+	if (!rc)
+		tegra_load_start();
+
 	return rc;
 }
 
@@ -288,6 +754,12 @@ static int tegra_cpufreq_init_once(void)
 	if (sched_setscheduler_nocheck(cpufreq_dfsd, SCHED_FIFO, &sp) < 0)
 		pr_err("%s: unable to elevate DVFS daemon priority\n",__func__);
 
+	/* deferrable, like ondemand: an idle CPU is not woken to sample */
+	INIT_DELAYED_WORK_DEFERRABLE(&gov_work, tegra_load_sample);
+	gov_wq = create_freezeable_workqueue("tegra_cpufreq");
+	if (!gov_wq)
+		pr_err("%s: unable to create load governor queue\n", __func__);
+
 clean:
 	if (rc) {
 		if (rm_cpufreq)
@@ -345,16 +817,85 @@ static struct cpufreq_driver s_tegra_cpufreq_driver = {
 
 };
 
+#ifdef CONFIG_DEBUG_FS
+
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+static int dbg_cpufreq_show(struct seq_file *s, void *unused)
+{
+	unsigned int i;
+
+	mutex_lock(&gov_mutex);
+	if (gov_running)
+		tegra_cpufreq_account();
+
+	seq_printf(s, "mode: %s\n", load_mode ? "load" : "nvrm");
+	seq_printf(s, "     khz      time_ms\n");
+	for (i = 0; i < stats.nr_states; i++)
+		seq_printf(s, "%8u %12llu\n", stats.state[i].khz,
+			   div_u64(stats.state[i].time_us, USEC_PER_MSEC));
+	seq_printf(s, "transitions: %lu\n", stats.transitions);
+	seq_printf(s, "latency_us: avg %llu max %u (%u timed, %u missed)\n",
+		   stats.lat_count ?
+		   div_u64(stats.lat_total_us, stats.lat_count) : 0,
+		   stats.lat_max_us, stats.lat_count, stats.lat_missed);
+	seq_printf(s, "boosts: %lu\n", stats.boosts);
+#ifdef CONFIG_HOTPLUG_CPU
+	seq_printf(s, "hotplug: %d up, %d down\n",
+		   atomic_read(&hotplug_ups), atomic_read(&hotplug_downs));
+#endif
+	mutex_unlock(&gov_mutex);
+	return 0;
+}
+
+static int dbg_cpufreq_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dbg_cpufreq_show, &inode->i_private);
+}
+
+static const struct file_operations debug_fops = {
+	.open		= dbg_cpufreq_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int __init tegra_cpufreq_debuginit(void)
+{
+	(void) debugfs_create_file("tegra_cpufreq", S_IRUGO,
+					NULL, NULL, &debug_fops);
+	return 0;
+}
+late_initcall(tegra_cpufreq_debuginit);
+#endif
+
 static int __init tegra_cpufreq_init(void)
 {
 #ifdef CONFIG_HOTPLUG_CPU
 	pm_notifier(tegra_cpufreq_pm_notifier, 0);
+#endif
+	hotcpu_notifier(tegra_cpu_load_notify, 0);
+#ifdef CONFIG_INPUT
+	if (input_register_handler(&tegra_boost_handler))
+		pr_err("%s: unable to register input boost\n", __func__);
 #endif
 	return cpufreq_register_driver(&s_tegra_cpufreq_driver);
 }
 
 static void __exit tegra_cpufreq_exit(void)
 {
+#ifdef CONFIG_INPUT
+	input_unregister_handler(&tegra_boost_handler);
+#endif
+	mutex_lock(&gov_mutex);
+	gov_running = false;
+	mutex_unlock(&gov_mutex);
+	if (gov_wq) {
+		cancel_delayed_work_sync(&gov_work);
+		cancel_work_sync(&boost_work);
+		destroy_workqueue(gov_wq);
+	}
 	kthread_stop(cpufreq_dfsd);
 	clk_put(clk_cpu);
 	unregister_reboot_notifier(&dfs_reboot_nb);
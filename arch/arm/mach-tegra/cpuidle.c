@@ -32,6 +32,9 @@
 #include <linux/interrupt.h>
 #include <mach/iomap.h>
 #include <linux/suspend.h>
+#include <linux/math64.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
 
 #include "power.h"
 
@@ -59,13 +62,146 @@ static int lp2_supported = 0;
 #define PMC_SCRATCH_38 0x134
 #define PMC_SCRATCH_39 0x138
 
+/*
+ * LP2 is entered on a predicted idle length rather than the raw distance
+ * to the next timer, in the manner of the menu governor: the timer
+ * distance is scaled by a correction factor learnt per order of magnitude
+ * from past idles, and capped by the mean of the last PREDICT_HISTORY idle
+ * lengths when those have been consistent.
+ */
+#define PREDICT_BUCKETS		6
+#define PREDICT_RESOLUTION	1024
+#define PREDICT_DECAY		4
+#define PREDICT_HISTORY		8
+
+/* wakeup latency buckets are powers of two from 32us up */
+#define LATENCY_BUCKETS		10
+
+enum {
+	TEGRA_IDLE_LP3,
+	TEGRA_IDLE_LP2,
+	TEGRA_IDLE_STATES,
+};
+
+struct tegra_idle_data {
+	u64 correction[PREDICT_BUCKETS];
+	unsigned int history[PREDICT_HISTORY];
+	unsigned int history_idx;
+
+	unsigned long entries[TEGRA_IDLE_STATES];
+	unsigned long too_short[TEGRA_IDLE_STATES];
+	unsigned long missed[TEGRA_IDLE_STATES];
+	unsigned long lp2_smp_blocked;
+	unsigned long latency[TEGRA_IDLE_STATES][LATENCY_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct tegra_idle_data, idle_data);
+
+static const char *tegra_idle_names[TEGRA_IDLE_STATES] = { "LP3", "LP2" };
+
 void __init tegra_init_idle(struct tegra_suspend_platform_data *plat)
 {
 	pwrgood_latency = plat->cpu_timer;
 }
 
-static int tegra_idle_enter_lp3(struct cpuidle_device *dev,
-	struct cpuidle_state *state)
+static int predict_bucket(s64 us)
+{
+	int bucket = 0;
+	s64 limit = 10;
+
+	while (bucket < PREDICT_BUCKETS - 1 && us >= limit) {
+		bucket++;
+		limit *= 10;
+	}
+	return bucket;
+}
+
+static s64 tegra_idle_predict(struct tegra_idle_data *d, s64 request)
+{
+	u64 avg = 0, var = 0;
+	s64 predicted;
+	int i;
+
+	if (request <= 0)
+		return 0;
+	request = min_t(s64, request, INT_MAX);
+
+	predicted = div_u64(request * d->correction[predict_bucket(request)],
+			    PREDICT_RESOLUTION * PREDICT_DECAY);
+
+	for (i = 0; i < PREDICT_HISTORY; i++)
+		avg += d->history[i];
+	avg = div_u64(avg, PREDICT_HISTORY);
+
+	for (i = 0; i < PREDICT_HISTORY; i++) {
+		s64 diff = (s64)d->history[i] - (s64)avg;
+		var += diff * diff;
+	}
+	var = div_u64(var, PREDICT_HISTORY);
+
+	/* standard deviation under 20us or a sixth of the mean */
+	if (avg && (var <= 400 || var * 36 <= avg * avg))
+		predicted = min_t(s64, predicted, avg);
+
+	return predicted;
+}
+
+static s64 lp2_threshold(struct cpuidle_device *dev)
+{
+	struct cpuidle_state *lp2 = &dev->states[TEGRA_IDLE_LP2];
+
+	if (dev->state_count <= TEGRA_IDLE_LP2)
+		return 0;
+	return lp2->exit_latency + lp2->target_residency;
+}
+
+/*
+ * Charges one idle period to the per-CPU statistics and feeds it back into
+ * the predictor. request is the next-timer distance at entry; lp2_possible
+ * says whether LP2 could have been entered had the idle been predicted
+ * long enough. Called with interrupts disabled.
+ */
+static void tegra_idle_account(struct cpuidle_device *dev, int state,
+	s64 request, s64 us, bool lp2_possible)
+{
+	struct tegra_idle_data *d = &per_cpu(idle_data, dev->cpu);
+	s64 threshold = lp2_threshold(dev);
+	s64 measured;
+	u64 factor;
+	int bucket;
+
+	d->entries[state]++;
+
+	if (threshold) {
+		if (state == TEGRA_IDLE_LP2 && us < threshold)
+			d->too_short[state]++;
+		else if (state == TEGRA_IDLE_LP3 && lp2_possible &&
+			 us >= threshold)
+			d->missed[state]++;
+	}
+
+	/* how long past the timer deadline the CPU came back */
+	if (request >= 0 && us >= request) {
+		bucket = fls((u32)min_t(s64, (us - request) >> 5, INT_MAX));
+		d->latency[state][min(bucket, LATENCY_BUCKETS - 1)]++;
+	}
+
+	if (request <= 0)
+		return;
+
+	request = min_t(s64, request, INT_MAX);
+	measured = clamp_t(s64, us, 0, request);
+	bucket = predict_bucket(request);
+
+	factor = d->correction[bucket] - d->correction[bucket] / PREDICT_DECAY;
+	factor += div_u64(PREDICT_RESOLUTION * measured, (u32)request);
+	d->correction[bucket] = factor ? factor : 1;
+
+	d->history[d->history_idx] = (unsigned int)measured;
+	d->history_idx = (d->history_idx + 1) % PREDICT_HISTORY;
+}
+
+static int __tegra_idle_enter_lp3(struct cpuidle_device *dev)
 {
 	void __iomem *flow_ctrl = IO_ADDRESS(TEGRA_FLOW_CTRL_BASE);
 	ktime_t enter, exit;
@@ -89,10 +225,24 @@ static int tegra_idle_enter_lp3(struct cpuidle_device *dev,
 	exit = ktime_get();
 	enter = ktime_sub(exit, enter);
 	us = ktime_to_us(enter);
-	local_irq_enable();
 	return (int)us;
 }
 
+static int tegra_idle_enter_lp3(struct cpuidle_device *dev,
+	struct cpuidle_state *state)
+{
+	s64 request = ktime_to_us(tick_nohz_get_sleep_length());
+	int us;
+
+	us = __tegra_idle_enter_lp3(dev);
+	smp_rmb();
+	tegra_idle_account(dev, TEGRA_IDLE_LP3, request, us,
+			   dev->cpu == 0 && lp2_supported &&
+			   !system_is_suspending);
+	local_irq_enable();
+	return us;
+}
+
 extern bool tegra_nvrm_lp2_allowed(void);
 extern unsigned int tegra_suspend_lp2(unsigned int);
 
@@ -100,18 +250,30 @@ static int tegra_idle_enter_lp2(struct cpuidle_device *dev,
 	struct cpuidle_state *state)
 {
 	ktime_t enter;
-	s64 request, us, latency, idle_us;
+	s64 request, next, predicted, us, latency, idle_us;
 	struct tick_sched *ts = tick_get_tick_sched(dev->cpu);
+	struct tegra_idle_data *d = &per_cpu(idle_data, dev->cpu);
 	unsigned int last_sample = (unsigned int)cpuidle_get_statedata(state);
+	bool allowed;
 
 	/* LP2 not possible when running in SMP mode */
 	smp_rmb();
 	idle_us = state->exit_latency + state->target_residency;
 	request = ktime_to_us(tick_nohz_get_sleep_length());
-	if (!lp2_supported || request <= idle_us || (!ts->tick_stopped) ||
-		system_is_suspending || (!tegra_nvrm_lp2_allowed())) {
+	next = request;
+	predicted = tegra_idle_predict(d, request);
+
+	allowed = lp2_supported && ts->tick_stopped &&
+		!system_is_suspending && tegra_nvrm_lp2_allowed();
+	if (dev->cpu == 0 && !lp2_supported && predicted > idle_us)
+		d->lp2_smp_blocked++;
+
+	if (!allowed || predicted <= idle_us) {
 		dev->last_state = &dev->states[0];
-		return tegra_idle_enter_lp3(dev, &dev->states[0]);
+		us = __tegra_idle_enter_lp3(dev);
+		tegra_idle_account(dev, TEGRA_IDLE_LP3, next, us, allowed);
+		local_irq_enable();
+		return (int)us;
 	}
 
 	local_irq_disable();
@@ -129,6 +291,7 @@ static int tegra_idle_enter_lp2(struct cpuidle_device *dev,
 	/* adjust kernel timers */
 	hrtimer_peek_ahead_timers();
 
+	tegra_idle_account(dev, TEGRA_IDLE_LP2, next, idle_us, true);
 	local_irq_enable();
 	return (int)idle_us;
 }
@@ -173,10 +336,82 @@ static int tegra_cpuidle_notifier(struct notifier_block *nfb,
 	return notification;
 }
 
+static ssize_t tegra_idle_stats_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	char *p = buf;
+	int cpu, i;
+
+	p += sprintf(p, "cpu state    entries  too_short     missed\n");
+	for_each_possible_cpu(cpu) {
+		struct tegra_idle_data *d = &per_cpu(idle_data, cpu);
+
+		for (i = 0; i < TEGRA_IDLE_STATES; i++) {
+			if (!d->entries[i])
+				continue;
+			p += sprintf(p, "%3d %5s %10lu %10lu %10lu\n", cpu,
+				tegra_idle_names[i], d->entries[i],
+				d->too_short[i], d->missed[i]);
+		}
+	}
+
+	/* LP2 gates the whole CPU complex, so it needs every other core off */
+	p += sprintf(p, "lp2 blocked by online cpus: %lu\n",
+		per_cpu(idle_data, 0).lp2_smp_blocked);
+	return p - buf;
+}
+
+static ssize_t tegra_idle_latency_show(struct kobject *kobj,
+	struct kobj_attribute *attr, char *buf)
+{
+	char *p = buf;
+	int cpu, i, b;
+
+	p += sprintf(p, "cpu state");
+	for (b = 0; b < LATENCY_BUCKETS - 1; b++)
+		p += sprintf(p, " %7u", 32 << b);
+	p += sprintf(p, "    more\n");
+
+	for_each_possible_cpu(cpu) {
+		struct tegra_idle_data *d = &per_cpu(idle_data, cpu);
+
+		for (i = 0; i < TEGRA_IDLE_STATES; i++) {
+			if (!d->entries[i])
+				continue;
+			p += sprintf(p, "%3d %5s", cpu, tegra_idle_names[i]);
+			for (b = 0; b < LATENCY_BUCKETS; b++)
+				p += sprintf(p, " %7lu", d->latency[i][b]);
+			p += sprintf(p, "\n");
+		}
+	}
+	return p - buf;
+}
+
+static struct kobj_attribute tegra_idle_stats_attr =
+	__ATTR(stats, 0444, tegra_idle_stats_show, NULL);
+
+static struct kobj_attribute tegra_idle_latency_attr =
+	__ATTR(wakeup_latency, 0444, tegra_idle_latency_show, NULL);
+
+static struct attribute *tegra_idle_attrs[] = {
+	&tegra_idle_stats_attr.attr,
+	&tegra_idle_latency_attr.attr,
+	NULL,
+};
+
+static struct attribute_group tegra_idle_attr_group = {
+	.attrs = tegra_idle_attrs,
+};
+
 static int tegra_idle_enter(unsigned int cpu)
 {
 	struct cpuidle_device *dev;
 	struct cpuidle_state *state;
+	struct tegra_idle_data *d = &per_cpu(idle_data, cpu);
+	int i;
+
+	for (i = 0; i < PREDICT_BUCKETS; i++)
+		d->correction[i] = PREDICT_RESOLUTION * PREDICT_DECAY;
 
 	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
 	if (!dev)
@@ -226,6 +461,7 @@ static int __init tegra_cpuidle_init(void)
 {
 	unsigned int cpu = smp_processor_id();
 	unsigned int reg;
+	struct kobject *kobj;
 	int ret;
 
 	lp2_supported = (num_online_cpus()==1);
@@ -241,6 +477,11 @@ static int __init tegra_cpuidle_init(void)
 		if (tegra_idle_enter(cpu))
 			pr_err("CPU%u: error initializing idle loop\n", cpu);
 	}
+
+	/* /sys/devices/system/cpu/tegra_idle */
+	kobj = kobject_create_and_add("tegra_idle", &cpu_sysdev_class.kset.kobj);
+	if (!kobj || sysfs_create_group(kobj, &tegra_idle_attr_group))
+		pr_err("%s: unable to create sysfs statistics\n", __func__);
 	return 0;
 }
 
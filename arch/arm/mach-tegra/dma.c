@@ -29,6 +29,7 @@
 #include <linux/err.h>
 #include <linux/irq.h>
 #include <linux/delay.h>
+#include <linux/scatterlist.h>
 #include <mach/dma.h>
 #include <mach/irqs.h>
 #include <mach/iomap.h>
@@ -125,6 +126,15 @@ struct tegra_dma_channel {
 	int			mode;
 	int			irq;
 
+	/* Requests completed from the ISR, waiting for their callback */
+	struct list_head	done;
+
+	/* Statistics, updated under the channel lock; bytes counts each
+	 * completed buffer once */
+	unsigned long		irqs;
+	unsigned long		thread_wakes;
+	unsigned long		bytes;
+
 	/* Register shadow */
 	u32			csr;
 	u32			ahb_seq;
@@ -181,15 +191,25 @@ void tegra_dma_stop(struct tegra_dma_channel *ch)
 
 int tegra_dma_cancel(struct tegra_dma_channel *ch)
 {
+	struct tegra_dma_req *req;
 	unsigned long irq_flags;
+	LIST_HEAD(done);
 
 	spin_lock_irqsave(&ch->lock, irq_flags);
 	while (!list_empty(&ch->list))
 		list_del(ch->list.next);
+	/* requests which already completed still get their callback */
+	list_splice_init(&ch->done, &done);
 
 	tegra_dma_stop(ch);
 
 	spin_unlock_irqrestore(&ch->lock, irq_flags);
+
+	while (!list_empty(&done)) {
+		req = list_entry(done.next, typeof(*req), node);
+		list_del(&req->node);
+		req->complete(req);
+	}
 	return 0;
 }
 
@@ -233,6 +253,10 @@ static unsigned int dma_active_count(struct tegra_dma_channel *ch,
 
 	bytes_transferred *= 4;
 
+	/* add the scatter-gather segments that have already completed */
+	if (req->sg)
+		bytes_transferred += req->sg_done;
+
 	return bytes_transferred;
 }
 #if defined(BLUETOOTH_DMA_PATCH)
@@ -425,7 +449,18 @@ int tegra_dma_dequeue_req(struct tegra_dma_channel *ch,
 		}
 	}
 	if (!found) {
+		/* completed in the ISR, but the IRQ thread has not delivered
+		 * it yet; hand it back as completed rather than aborted */
+		list_for_each_entry(req, &ch->done, node) {
+			if (req == _req) {
+				list_del(&req->node);
+				found = 1;
+				break;
+			}
+		}
 		spin_unlock_irqrestore(&ch->lock, irq_flags);
+		if (found)
+			req->complete(req);
 		return 0;
 	}
 
@@ -504,18 +539,12 @@ bool tegra_dma_is_req_inflight(struct tegra_dma_channel *ch,
 }
 EXPORT_SYMBOL(tegra_dma_is_req_inflight);
 
-int tegra_dma_enqueue_req(struct tegra_dma_channel *ch,
+static void __tegra_dma_enqueue_req(struct tegra_dma_channel *ch,
 	struct tegra_dma_req *req)
 {
 	unsigned long irq_flags;
 	int start_dma = 0;
 
-	if (req->size > NV_DMA_MAX_TRASFER_SIZE ||
-		req->source_addr & 0x3 || req->dest_addr & 0x3) {
-		pr_err("Invalid DMA request for channel %d\n", ch->id);
-		return -EINVAL;
-	}
-
 	spin_lock_irqsave(&ch->lock, irq_flags);
 
 	req->bytes_transferred = 0;
@@ -530,11 +559,60 @@ int tegra_dma_enqueue_req(struct tegra_dma_channel *ch,
 		tegra_dma_update_hw(ch, req);
 
 	spin_unlock_irqrestore(&ch->lock, irq_flags);
+}
 
+int tegra_dma_enqueue_req(struct tegra_dma_channel *ch,
+	struct tegra_dma_req *req)
+{
+	if (req->size > NV_DMA_MAX_TRASFER_SIZE ||
+		req->source_addr & 0x3 || req->dest_addr & 0x3) {
+		pr_err("Invalid DMA request for channel %d\n", ch->id);
+		return -EINVAL;
+	}
+
+	req->sg = NULL;
+	__tegra_dma_enqueue_req(ch, req);
 	return 0;
 }
 EXPORT_SYMBOL(tegra_dma_enqueue_req);
 
+/* Queue a request whose memory side is described by a scatterlist that
+ * has already been mapped with dma_map_sg. Only one-shot channels can
+ * chain segments; each segment has the same limits as a plain request.
+ */
+int tegra_dma_enqueue_sg_req(struct tegra_dma_channel *ch,
+	struct tegra_dma_req *req, struct scatterlist *sgl, unsigned int nents)
+{
+	struct scatterlist *sg;
+	unsigned int size = 0;
+	unsigned long dev_addr;
+	int i;
+
+	dev_addr = req->to_memory ? req->source_addr : req->dest_addr;
+	if (!(ch->mode & TEGRA_DMA_MODE_ONESHOT) || !nents || dev_addr & 0x3)
+		goto invalid;
+
+	for_each_sg(sgl, sg, nents, i) {
+		unsigned int len = sg_dma_len(sg);
+
+		if (!len || len > NV_DMA_MAX_TRASFER_SIZE || len & 0x3 ||
+		    sg_dma_address(sg) & 0x3)
+			goto invalid;
+		size += len;
+	}
+
+	req->sg = sgl;
+	req->sg_len = nents;
+	req->size = size;
+	__tegra_dma_enqueue_req(ch, req);
+	return 0;
+
+invalid:
+	pr_err("Invalid DMA sg request for channel %d\n", ch->id);
+	return -EINVAL;
+}
+EXPORT_SYMBOL(tegra_dma_enqueue_sg_req);
+
 struct tegra_dma_channel *tegra_dma_allocate_channel(int mode)
 {
 	int channel;
@@ -547,7 +625,7 @@ struct tegra_dma_channel *tegra_dma_allocate_channel(int mode)
 		channel = find_first_zero_bit(channel_usage,
 			ARRAY_SIZE(dma_channels));
 		if (channel >= ARRAY_SIZE(dma_channels))
-			return ERR_PTR(ENODEV);
+			return ERR_PTR(-ENODEV);
 	}
 	__set_bit(channel, channel_usage);
 	ch = &dma_channels[channel];
@@ -583,7 +661,7 @@ static void tegra_dma_update_hw_partial(struct tegra_dma_channel *ch,
 }
 
 static void set_burst_size(struct tegra_dma_channel *ch,
-	struct tegra_dma_req *req)
+	struct tegra_dma_req *req, unsigned int size)
 {
 	ch->ahb_seq &= ~AHB_SEQ_BURST_MASK;
 	switch(req->req_sel) {
@@ -595,7 +673,7 @@ static void set_burst_size(struct tegra_dma_channel *ch,
 		/* For spi/slink the burst size based on transfer size
 		 * i.e. if multiple of 16 bytes then busrt is
 		 * 4 word else burst size is 1 word */
-		if (req->size & 0xF)
+		if (size & 0xF)
 			ch->ahb_seq |= AHB_SEQ_BURST_1;
 		else
 			ch->ahb_seq |= AHB_SEQ_BURST_4;
@@ -620,12 +698,20 @@ static void tegra_dma_update_hw(struct tegra_dma_channel *ch,
 	int apb_bus_width;
 	int index;
 	unsigned long csr;
+	unsigned int size = req->size;
+
+	if (req->sg) {
+		req->sg_cur = req->sg;
+		req->sg_left = req->sg_len;
+		req->sg_done = 0;
+		size = sg_dma_len(req->sg_cur);
+	}
 
 	ch->csr |= CSR_FLOW;
 	ch->csr &= ~CSR_REQ_SEL_MASK;
 	ch->csr |= req->req_sel << CSR_REQ_SEL_SHIFT;
 
-	set_burst_size(ch, req);
+	set_burst_size(ch, req, size);
 
 	/* One shot mode is always single buffered,
 	 * continuous mode is always double buffered
@@ -634,7 +720,7 @@ static void tegra_dma_update_hw(struct tegra_dma_channel *ch,
 		ch->csr |= CSR_ONCE;
 		ch->ahb_seq &= ~AHB_SEQ_DBL_BUF;
 		ch->csr &= ~CSR_WCOUNT_MASK;
-		ch->csr |= ((req->size>>2) - 1) << CSR_WCOUNT_SHIFT;
+		ch->csr |= ((size>>2) - 1) << CSR_WCOUNT_SHIFT;
 	} else {
 		ch->csr &= ~CSR_ONCE;
 		ch->ahb_seq |= AHB_SEQ_DBL_BUF;
@@ -667,6 +753,9 @@ static void tegra_dma_update_hw(struct tegra_dma_channel *ch,
 		ahb_bus_width = req->source_bus_width;
 	}
 
+	if (req->sg)
+		ch->ahb_ptr = sg_dma_address(req->sg_cur);
+
 	apb_addr_wrap >>= 2;
 	ahb_addr_wrap >>= 2;
 
@@ -723,6 +812,33 @@ static void tegra_dma_update_hw(struct tegra_dma_channel *ch,
 	req->status = TEGRA_DMA_REQ_INFLIGHT;
 }
 
+/* Move a scatter-gather request on to its next segment. Only the word
+ * count, burst size and memory pointer change between segments, so this
+ * is cheap enough to run from the hard interrupt handler.
+ *
+ * should be called with the channel lock held */
+static void tegra_dma_update_hw_sg(struct tegra_dma_channel *ch,
+	struct tegra_dma_req *req)
+{
+	unsigned int size;
+
+	req->sg_done += sg_dma_len(req->sg_cur);
+	req->sg_cur = sg_next(req->sg_cur);
+	req->sg_left--;
+	size = sg_dma_len(req->sg_cur);
+
+	set_burst_size(ch, req, size);
+	ch->csr &= ~CSR_WCOUNT_MASK;
+	ch->csr |= ((size>>2) - 1) << CSR_WCOUNT_SHIFT;
+	ch->ahb_ptr = sg_dma_address(req->sg_cur);
+
+	writel(ch->csr, ch->addr + APB_DMA_CHAN_CSR);
+	writel(ch->apb_ptr, ch->addr + APB_DMA_CHAN_APB_PTR);
+	writel(ch->ahb_seq, ch->addr + APB_DMA_CHAN_AHB_SEQ);
+	writel(ch->ahb_ptr, ch->addr + APB_DMA_CHAN_AHB_PTR);
+	writel(ch->csr | CSR_ENB, ch->addr + APB_DMA_CHAN_CSR);
+}
+
 static void tegra_dma_init_hw(struct tegra_dma_channel *ch)
 {
 	/* One shot with an interrupt to CPU after transfer */
@@ -731,87 +847,115 @@ static void tegra_dma_init_hw(struct tegra_dma_channel *ch)
 	ch->apb_seq = APB_SEQ_BUS_WIDTH_32 | 1 << APB_SEQ_WRAP_SHIFT;
 }
 
-static void handle_oneshot_dma(struct tegra_dma_channel *ch)
+/* One-shot completion, run from the hard interrupt with the channel lock
+ * held. The next segment of a scatter-gather request, or the next queued
+ * request, is programmed straight away so the channel does not sit idle
+ * waiting for the IRQ thread. Completed requests are moved to ch->done and
+ * their callbacks run from the thread, which drains every request that
+ * completed since it last ran in one pass.
+ */
+static irqreturn_t isr_oneshot_dma(struct tegra_dma_channel *ch)
 {
 	struct tegra_dma_req *req;
-	#if defined(BLUETOOTH_DMA_PATCH)
-		spin_lock(&ch->lock);
-	if (list_empty(&ch->list)) {
-		spin_unlock(&ch->lock);
-		return;
+	int bytes_transferred;
+
+	if (list_empty(&ch->list))
+		return IRQ_HANDLED;
+
+	req = list_entry(ch->list.next, typeof(*req), node);
+
+	bytes_transferred = (ch->csr & CSR_WCOUNT_MASK) >> CSR_WCOUNT_SHIFT;
+	bytes_transferred += 1;
+	bytes_transferred <<= 2;
+
+	if (req->sg && req->sg_left > 1) {
+		tegra_dma_update_hw_sg(ch, req);
+		return IRQ_HANDLED;
 	}
-	#else
-	unsigned long irq_flags;
 
-	spin_lock_irqsave(&ch->lock, irq_flags);
-	if (list_empty(&ch->list)) {
-		spin_unlock_irqrestore(&ch->lock, irq_flags);
-		return;
+	if (req->sg)
+		bytes_transferred += req->sg_done;
+
+	list_move_tail(&req->node, &ch->done);
+	req->bytes_transferred = bytes_transferred;
+	req->status = TEGRA_DMA_REQ_SUCCESS;
+	ch->bytes += bytes_transferred;
+
+	if (!list_empty(&ch->list)) {
+		req = list_entry(ch->list.next, typeof(*req), node);
+		tegra_dma_update_hw(ch, req);
 	}
-	#endif
-	
-	req = list_entry(ch->list.next, typeof(*req), node);
-	if (req) {
-		int bytes_transferred;
+	return IRQ_WAKE_THREAD;
+}
 
-		bytes_transferred =
-			(ch->csr & CSR_WCOUNT_MASK) >> CSR_WCOUNT_SHIFT;
-		bytes_transferred += 1;
-		bytes_transferred <<= 2;
+static void handle_oneshot_dma(struct tegra_dma_channel *ch)
+{
+	struct tegra_dma_req *req;
+	unsigned long irq_flags;
 
+	spin_lock_irqsave(&ch->lock, irq_flags);
+	while (!list_empty(&ch->done)) {
+		req = list_entry(ch->done.next, typeof(*req), node);
 		list_del(&req->node);
-		req->bytes_transferred = bytes_transferred;
-		req->status = TEGRA_DMA_REQ_SUCCESS;
-		#if defined(BLUETOOTH_DMA_PATCH)
-		spin_unlock(&ch->lock);
-		/* Callback should be called without any lock */
-		pr_debug("%s: transferred %d bytes\n", __func__,
-			req->bytes_transferred);
-		req->complete(req);
-		spin_lock(&ch->lock);
-		#else
 		spin_unlock_irqrestore(&ch->lock, irq_flags);
 		/* Callback should be called without any lock */
 		pr_debug("%s: transferred %d bytes\n", __func__,
 			req->bytes_transferred);
 		req->complete(req);
 		spin_lock_irqsave(&ch->lock, irq_flags);
-		#endif
 	}
+	spin_unlock_irqrestore(&ch->lock, irq_flags);
+}
 
-	if (!list_empty(&ch->list)) {
-		req = list_entry(ch->list.next, typeof(*req), node);
-		/* the complete function we just called may have enqueued another
-		   req, in which case dma has already started */
-		if (req->status != TEGRA_DMA_REQ_INFLIGHT)
-			tegra_dma_update_hw(ch, req);
+/* Half buffer interrupt of a continuous request, run from the hard
+ * interrupt with the channel lock held. When the client has no threshold
+ * callback the only work is to load the next request's pointers, so do
+ * that here and skip the thread. Everything else, including any state the
+ * thread has not caught up with yet, is left to handle_continuous_dma.
+ */
+static irqreturn_t isr_continuous_dma(struct tegra_dma_channel *ch)
+{
+	struct tegra_dma_req *req;
+	struct tegra_dma_req *next_req;
+	bool is_dma_ping_complete;
+
+	if (list_empty(&ch->list))
+		return IRQ_WAKE_THREAD;
+
+	req = list_entry(ch->list.next, typeof(*req), node);
+	if (req->threshold ||
+	    req->buffer_status != TEGRA_DMA_REQ_BUF_STATUS_EMPTY ||
+	    ch->mode == TEGRA_DMA_MODE_CONTINUOUS_SAME_BUFFER)
+		return IRQ_WAKE_THREAD;
+
+	is_dma_ping_complete = (readl(ch->addr + APB_DMA_CHAN_STA)
+				& STA_PING_PONG) ? true : false;
+	if (req->to_memory)
+		is_dma_ping_complete = !is_dma_ping_complete;
+	if (!is_dma_ping_complete)
+		return IRQ_WAKE_THREAD;
+
+	if (!list_is_last(&req->node, &ch->list)) {
+		next_req = list_entry(req->node.next, typeof(*next_req), node);
+		tegra_dma_update_hw_partial(ch, next_req);
 	}
-	#if defined(BLUETOOTH_DMA_PATCH)
-	spin_unlock(&ch->lock);
-	#else
-	spin_unlock_irqrestore(&ch->lock, irq_flags);
-	#endif
+	req->buffer_status = TEGRA_DMA_REQ_BUF_STATUS_HALF_FULL;
+	req->status = TEGRA_DMA_REQ_SUCCESS;
+	return IRQ_HANDLED;
 }
 
 static void handle_continuous_dma(struct tegra_dma_channel *ch)
 {
 	struct tegra_dma_req *req;
 	struct tegra_dma_req *next_req;
-	#if defined(BLUETOOTH_DMA_PATCH)
-	spin_lock(&ch->lock);
-	if (list_empty(&ch->list)) {
-		spin_unlock(&ch->lock);
-		return;
-	}
-	#else
 	unsigned long irq_flags;
 
+	/* the ISR takes the channel lock too, so keep interrupts off */
 	spin_lock_irqsave(&ch->lock, irq_flags);
 	if (list_empty(&ch->list)) {
 		spin_unlock_irqrestore(&ch->lock, irq_flags);
 		return;
 	}
-	#endif
 	req = list_entry(ch->list.next, typeof(*req), node);
 	if (req) {
 		if (req->buffer_status == TEGRA_DMA_REQ_BUF_STATUS_EMPTY) {
@@ -831,6 +975,7 @@ static void handle_continuous_dma(struct tegra_dma_channel *ch)
 				req->buffer_status = TEGRA_DMA_REQ_BUF_STATUS_FULL;
 				req->bytes_transferred = bytes_transferred;
 				req->status = TEGRA_DMA_REQ_SUCCESS;
+				ch->bytes += bytes_transferred;
 				tegra_dma_stop(ch);
 
 				if (!list_is_last(&req->node, &ch->list)) {
@@ -842,13 +987,8 @@ static void handle_continuous_dma(struct tegra_dma_channel *ch)
 				}
 
 				list_del(&req->node);
-				#if defined(BLUETOOTH_DMA_PATCH)
-				/* DMA lock is NOT held when callbak is called */
-				spin_unlock(&ch->lock);
-				#else
 				/* DMA lock is NOT held when callbak is called */
 				spin_unlock_irqrestore(&ch->lock, irq_flags);
-				#endif
 				req->complete(req);
 				return;
 			}
@@ -868,7 +1008,7 @@ static void handle_continuous_dma(struct tegra_dma_channel *ch)
 				req->status = TEGRA_DMA_REQ_INFLIGHT;
 			}
 			/* DMA lock is NOT held when callback is called */
-			spin_unlock(&ch->lock);
+			spin_unlock_irqrestore(&ch->lock, irq_flags);
 			 #else
 			if (!list_is_last(&req->node, &ch->list)) {
 				next_req = list_entry(req->node.next,
@@ -898,6 +1038,7 @@ static void handle_continuous_dma(struct tegra_dma_channel *ch)
 			req->buffer_status = TEGRA_DMA_REQ_BUF_STATUS_FULL;
 			req->bytes_transferred = bytes_transferred;
 			req->status = TEGRA_DMA_REQ_SUCCESS;
+			ch->bytes += bytes_transferred;
 			#if defined(BLUETOOTH_DMA_PATCH)
 			if (ch->mode != TEGRA_DMA_MODE_CONTINUOUS_SAME_BUFFER) {
 				if (list_is_last(&req->node, &ch->list)) {
@@ -917,12 +1058,12 @@ static void handle_continuous_dma(struct tegra_dma_channel *ch)
 				list_del(&req->node);
 
 				/* DMA lock is NOT held when callbak is called */
-				spin_unlock(&ch->lock);
+				spin_unlock_irqrestore(&ch->lock, irq_flags);
 				req->complete(req);
 			} else {
 				req->buffer_status = TEGRA_DMA_REQ_BUF_STATUS_EMPTY;
 				req->status = TEGRA_DMA_REQ_INFLIGHT;
-				spin_unlock(&ch->lock);
+				spin_unlock_irqrestore(&ch->lock, irq_flags);
 				if (likely(req->threshold))
 					req->threshold(req);
 			}
@@ -956,11 +1097,7 @@ static void handle_continuous_dma(struct tegra_dma_channel *ch)
 			BUG();
 		}
 	}
-	#if defined(BLUETOOTH_DMA_PATCH)
-	spin_unlock(&ch->lock);	
-	#else
 	spin_unlock_irqrestore(&ch->lock, irq_flags);
-	#endif
 }
 
 
@@ -981,6 +1118,8 @@ static irqreturn_t dma_isr(int irq, void *data)
 {
 	struct tegra_dma_channel *ch = data;
 	unsigned long status;
+	unsigned long irq_flags;
+	irqreturn_t ret;
 
 	status = readl(ch->addr + APB_DMA_CHAN_STA);
 	if (status & STA_ISE_EOC)
@@ -989,7 +1128,20 @@ static irqreturn_t dma_isr(int irq, void *data)
 		pr_warning("Got a spurious ISR for DMA channel %d\n", ch->id);
 		return IRQ_HANDLED;
 	}
-	return IRQ_WAKE_THREAD;
+
+	spin_lock_irqsave(&ch->lock, irq_flags);
+	ch->irqs++;
+
+	if (ch->mode & TEGRA_DMA_MODE_ONESHOT)
+		ret = isr_oneshot_dma(ch);
+	else
+		ret = isr_continuous_dma(ch);
+
+	if (ret == IRQ_WAKE_THREAD)
+		ch->thread_wakes++;
+	spin_unlock_irqrestore(&ch->lock, irq_flags);
+
+	return ret;
 }
 int __init tegra_dma_init(void)
 {
@@ -1024,6 +1176,7 @@ int __init tegra_dma_init(void)
 
 		spin_lock_init(&ch->lock);
 		INIT_LIST_HEAD(&ch->list);
+		INIT_LIST_HEAD(&ch->done);
 		tegra_dma_init_hw(ch);
 
 		irq = INT_APB_DMA_CH0 + i;
@@ -1101,3 +1254,45 @@ void tegra_dma_resume(void)
 }
 
 #endif
+
+#ifdef CONFIG_DEBUG_FS
+
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+static int dbg_dma_show(struct seq_file *s, void *unused)
+{
+	int i;
+
+	seq_printf(s, "chan       irqs    threads          bytes\n");
+	for (i = TEGRA_SYSTEM_DMA_CH_MIN; i <= TEGRA_SYSTEM_DMA_CH_MAX; i++) {
+		struct tegra_dma_channel *ch = &dma_channels[i];
+
+		if (!ch->irqs)
+			continue;
+		seq_printf(s, "%4d %10lu %10lu %14lu\n",
+			ch->id, ch->irqs, ch->thread_wakes, ch->bytes);
+	}
+	return 0;
+}
+
+static int dbg_dma_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, dbg_dma_show, &inode->i_private);
+}
+
+static const struct file_operations debug_fops = {
+	.open		= dbg_dma_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int __init tegra_dma_debuginit(void)
+{
+	(void) debugfs_create_file("tegra_dma", S_IRUGO,
+					NULL, NULL, &debug_fops);
+	return 0;
+}
+late_initcall(tegra_dma_debuginit);
+#endif
@@ -22,6 +22,7 @@
 #define __MACH_TEGRA_DMA_H
 
 #include <linux/list.h>
+#include <linux/scatterlist.h>
 
 #if defined(CONFIG_TEGRA_SYSTEM_DMA)
 #define BLUETOOTH_DMA_PATCH
@@ -129,6 +130,18 @@ struct tegra_dma_req {
 	unsigned long req_sel;
 	unsigned int size;
 
+	/* Scatter-gather list, filled in by tegra_dma_enqueue_sg_req. The
+	 * memory side of each segment is taken from the list in turn while
+	 * the device side stays at source_addr/dest_addr. Segments after the
+	 * first are programmed from the DMA interrupt, and complete is only
+	 * called once the whole list has been transferred.
+	 */
+	struct scatterlist *sg;
+	unsigned int sg_len;
+	struct scatterlist *sg_cur;
+	unsigned int sg_left;
+	unsigned int sg_done;
+
 	/* Updated by the DMA driver on the conpletion of the request. */
 	int bytes_transferred;
 	int status;
@@ -142,6 +155,8 @@ struct tegra_dma_req {
 
 int tegra_dma_enqueue_req(struct tegra_dma_channel *ch,
 	struct tegra_dma_req *req);
+int tegra_dma_enqueue_sg_req(struct tegra_dma_channel *ch,
+	struct tegra_dma_req *req, struct scatterlist *sgl, unsigned int nents);
 int tegra_dma_dequeue_req(struct tegra_dma_channel *ch,
 	struct tegra_dma_req *req);
 void tegra_dma_dequeue(struct tegra_dma_channel *ch);
@@ -74,6 +74,8 @@ struct tegra_iovmm_client {
 	struct iovmm_share_group	*group;
 	struct tegra_iovmm_domain	*domain;
 	struct list_head		list;
+	size_t				quota;	   /* 0 for unlimited */
+	size_t				committed; /* under block_lock */
 };
 
 /* tegra_iovmm_area serves a purpose analagous to vm_area_struct as defined
@@ -135,6 +137,12 @@ struct tegra_iovmm_client *tegra_iovmm_alloc_client(const char *name,
 
 size_t tegra_iovmm_get_vm_size(struct tegra_iovmm_client *client);
 
+/* limits the I/O virtual address space which the client may have
+ * allocated at once; tegra_iovmm_create_vm fails past the quota. a quota
+ * of 0 removes the limit */
+int tegra_iovmm_client_set_quota(struct tegra_iovmm_client *client,
+	size_t quota);
+
 void tegra_iovmm_free_client(struct tegra_iovmm_client *client);
 
 /* called by clients to ensure that their mapping context is resident
@@ -211,6 +219,12 @@ static inline size_t tegra_iovmm_get_vm_size(struct tegra_iovmm_client *client)
 	return 0;
 }
 
+static inline int tegra_iovmm_client_set_quota(
+	struct tegra_iovmm_client *client, size_t quota)
+{
+	return 0;
+}
+
 static inline void tegra_iovmm_free_client(struct tegra_iovmm_client *client)
 {}
 
@@ -57,6 +57,7 @@ struct tegra_iovmm_block {
 	unsigned long		poison;
 	struct rb_node		free_node;
 	struct rb_node		all_node;
+	struct tegra_iovmm_client *client; /* charged for this block */
 };
 
 struct iovmm_share_group {
@@ -127,6 +128,7 @@ static int tegra_iovmm_read_proc(char *page, char **start, off_t off,
 	struct iovmm_share_group *grp;
 	tegra_iovmm_addr_t max_free, total_free, total;
 	unsigned int num, num_free;
+	struct tegra_iovmm_client *c;
 
 	int len = 0;
 
@@ -147,6 +149,16 @@ static int tegra_iovmm_read_proc(char *page, char **start, off_t off,
 			len += iovmprint("\t\tsize: %uKiB free: %uKiB "
 				"largest: %uKiB (%u free / %u total blocks)\n",
 				total, total_free, max_free, num_free, num);
+			spin_lock(&grp->lock);
+			list_for_each_entry(c, &grp->client_list, list) {
+				len += iovmprint("\t\tclient %s: %uKiB",
+					c->name, c->committed >> 10);
+				if (c->quota)
+					len += iovmprint(" of %uKiB",
+						c->quota >> 10);
+				len += iovmprint("\n");
+			}
+			spin_unlock(&grp->lock);
 		}
 	}
 	mutex_unlock(&iovmm_list_lock);
@@ -177,6 +189,10 @@ static void iovmm_free_block(struct tegra_iovmm_domain *domain,
 	iovmm_block_put(block);
 
 	spin_lock(&domain->block_lock);
+	if (block->client) {
+		block->client->committed -= iovmm_length(block);
+		block->client = NULL;
+	}
 	temp = rb_prev(&block->all_node);
 	if (temp)
 		pred = rb_entry(temp, struct tegra_iovmm_block, all_node);
@@ -226,22 +242,18 @@ static void iovmm_free_block(struct tegra_iovmm_domain *domain,
 	spin_unlock(&domain->block_lock);
 }
 
-/* if the best-fit block is larger than the requested size, a remainder
- * block will be created and inserted into the free list in its place.
- * since all free blocks are stored in two trees the new block needs to be
- * linked into both. */
+/* if the best-fit block is larger than the requested size, the remainder
+ * block 'rem' will be initialized and inserted into the free list in its
+ * place. since all free blocks are stored in two trees the new block needs
+ * to be linked into both. must be called with block_lock held. */
 static void iovmm_split_free_block(struct tegra_iovmm_domain *domain,
-	struct tegra_iovmm_block *block, unsigned long size)
+	struct tegra_iovmm_block *block, struct tegra_iovmm_block *rem,
+	unsigned long size)
 {
 	struct rb_node **p;
 	struct rb_node *parent = NULL;
-	struct tegra_iovmm_block *rem;
 	struct tegra_iovmm_block *b;
 
-	rem = kmem_cache_zalloc(iovmm_cache, GFP_KERNEL);
-	if (!rem) return;
-
-	spin_lock(&domain->block_lock);
 	p = &domain->free_blocks.rb_node;
 
 	iovmm_start(rem) = iovmm_start(block) + size;
@@ -275,21 +287,28 @@ static void iovmm_split_free_block(struct tegra_iovmm_domain *domain,
 	rb_insert_color(&rem->all_node, &domain->all_blocks);
 }
 
+/* finds the smallest free block which can satisfy the request in the
+ * size-ordered free tree and charges it to the client. the search and the
+ * split happen in a single critical section; if the best fit needs to be
+ * split and no remainder block is at hand yet, one is allocated outside
+ * block_lock and the search is repeated. */
 static struct tegra_iovmm_block *iovmm_alloc_block(
-	struct tegra_iovmm_domain *domain, unsigned long size)
+	struct tegra_iovmm_client *client, unsigned long size)
 {
+	struct tegra_iovmm_domain *domain = client->domain;
 	struct rb_node *n;
-	struct tegra_iovmm_block *b, *best;
-        static int splitting = 0;
+	struct tegra_iovmm_block *b, *best, *rem = NULL;
+	bool split, nosplit = false;
 
 	BUG_ON(!size);
 	size = iovmm_align_up(domain->dev, size);
-        for (;;) {
-		spin_lock(&domain->block_lock);
-		if (!splitting)
-			break;
+
+again:
+	spin_lock(&domain->block_lock);
+	if (client->quota && client->committed + size > client->quota) {
 		spin_unlock(&domain->block_lock);
-		schedule();
+		if (rem) kmem_cache_free(iovmm_cache, rem);
+		return NULL;
 	}
 	n = domain->free_blocks.rb_node;
 	best = NULL;
@@ -306,20 +325,29 @@ static struct tegra_iovmm_block *iovmm_alloc_block(
 	}
 	if (!best) {
 		spin_unlock(&domain->block_lock);
+		if (rem) kmem_cache_free(iovmm_cache, rem);
 		return NULL;
 	}
+	split = iovmm_length(best) >= size+MIN_SPLIT_BYTES(domain);
+	if (split && !rem && !nosplit) {
+		spin_unlock(&domain->block_lock);
+		rem = kmem_cache_zalloc(iovmm_cache, GFP_KERNEL);
+		if (!rem) nosplit = true;
+		goto again;
+	}
 	rb_erase(&best->free_node, &domain->free_blocks);
 	clear_bit(BK_free, &best->flags);
 	atomic_inc(&best->ref);
-	if (iovmm_length(best) >= size+MIN_SPLIT_BYTES(domain)) {
-		splitting = 1;
-		spin_unlock(&domain->block_lock);
-		iovmm_split_free_block(domain, best, size);
-		splitting = 0;
+	if (split && rem) {
+		iovmm_split_free_block(domain, best, rem, size);
+		rem = NULL;
 	}
+	best->client = client;
+	client->committed += iovmm_length(best);
 
 	spin_unlock(&domain->block_lock);
 
+	if (rem) kmem_cache_free(iovmm_cache, rem);
 	return best;
 }
 
@@ -360,7 +388,7 @@ struct tegra_iovmm_area *tegra_iovmm_create_vm(
 
 	dev = client->domain->dev;
 
-	b = iovmm_alloc_block(client->domain, size);
+	b = iovmm_alloc_block(client, size);
 	if (!b) return NULL;
 
 	b->vm_area.domain = client->domain;
@@ -612,8 +640,20 @@ size_t tegra_iovmm_get_vm_size(struct tegra_iovmm_client *client)
 	return size;
 }
 
+int tegra_iovmm_client_set_quota(struct tegra_iovmm_client *client,
+	size_t quota)
+{
+	if (!client) return -ENODEV;
+
+	spin_lock(&client->domain->block_lock);
+	client->quota = quota;
+	spin_unlock(&client->domain->block_lock);
+	return 0;
+}
+
 void tegra_iovmm_free_client(struct tegra_iovmm_client *client)
 {
+	struct rb_node *n;
 	struct tegra_iovmm_device *dev;
 	if (!client) return;
 
@@ -631,11 +671,23 @@ void tegra_iovmm_free_client(struct tegra_iovmm_client *client)
 			wake_up(&client->domain->delay_lock);
 		}
 	}
+	/* areas may outlive their client; stop charging them to it */
+	spin_lock(&client->domain->block_lock);
+	for (n = rb_first(&client->domain->all_blocks); n; n = rb_next(n)) {
+		struct tegra_iovmm_block *b;
+		b = rb_entry(n, struct tegra_iovmm_block, all_node);
+		if (b->client == client)
+			b->client = NULL;
+	}
+	spin_unlock(&client->domain->block_lock);
+
 	mutex_lock(&iovmm_list_lock);
 	if (!atomic_dec_return(&client->domain->clients))
 		if (dev->ops->free_domain)
 			dev->ops->free_domain(dev, client->domain);
+	spin_lock(&client->group->lock);
 	list_del(&client->list);
+	spin_unlock(&client->group->lock);
 	if (list_empty(&client->group->client_list)) {
 		list_del(&client->group->group_list);
 		if (client->group->name) kfree(client->group->name);
@@ -30,6 +30,7 @@
 #include <linux/mutex.h>
 #include <linux/scatterlist.h>
 #include <linux/string_helpers.h>
+#include <linux/log2.h>
 
 #include <linux/mmc/card.h>
 #include <linux/mmc/host.h>
@@ -51,6 +52,20 @@ MODULE_ALIAS("mmc:block");
 
 static DECLARE_BITMAP(dev_use, MMC_NUM_MINORS);
 
+/*
+ * Request sizes are counted in power of two buckets of sectors, the last
+ * one taking everything from 256K up.
+ */
+#define MMC_BLK_SIZE_BUCKETS	10
+
+struct mmc_blk_stats {
+	unsigned long	rd_size[MMC_BLK_SIZE_BUCKETS];
+	unsigned long	wr_size[MMC_BLK_SIZE_BUCKETS];
+	unsigned long	packed_cmds;	/* packed writes issued */
+	unsigned long	packed_reqs;	/* requests carried by them */
+	unsigned long	packed_fails;	/* packed writes redone one by one */
+};
+
 /*
  * There is one mmc_blk_data per slot.
  */
@@ -61,6 +76,12 @@ struct mmc_blk_data {
 
 	unsigned int	usage;
 	unsigned int	read_only;
+	unsigned int	packed_wr;	/* merge queued writes */
+
+	struct mmc_blk_stats stats;
+#ifdef CONFIG_DEBUG_FS
+	struct dentry	*debugfs_stats;
+#endif
 };
 
 static DEFINE_MUTEX(open_lock);
@@ -144,13 +165,6 @@ static const struct block_device_operations mmc_bdops = {
 	.owner			= THIS_MODULE,
 };
 
-struct mmc_blk_request {
-	struct mmc_request	mrq;
-	struct mmc_command	cmd;
-	struct mmc_command	stop;
-	struct mmc_data		data;
-};
-
 static u32 mmc_sd_num_wr_blocks(struct mmc_card *card)
 {
 	int err;
@@ -268,116 +282,345 @@ mmc_blk_set_blksize(struct mmc_blk_data *md, struct mmc_card *card)
 }
 
 
-static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
+/*
+ * Waits for the card to leave the programming state after a write.
+ */
+static int mmc_blk_wait_for_ready(struct mmc_card *card, struct request *req)
 {
-	struct mmc_blk_data *md = mq->data;
-	struct mmc_card *card = md->queue.card;
-	struct mmc_blk_request brq;
-	int ret = 1, disable_multi = 0;
+	struct mmc_command cmd;
+	int err;
 
-#ifdef CONFIG_MMC_BLOCK_DEFERRED_RESUME
-	if (mmc_bus_needs_resume(card->host)) {
-		mmc_resume_bus(card->host);
-		mmc_blk_set_blksize(md, card);
+	do {
+		memset(&cmd, 0, sizeof(struct mmc_command));
+		cmd.opcode = MMC_SEND_STATUS;
+		cmd.arg = card->rca << 16;
+		cmd.flags = MMC_RSP_R1 | MMC_CMD_AC;
+		err = mmc_wait_for_cmd(card->host, &cmd, 5);
+		if (err) {
+			printk(KERN_ERR "%s: error %d requesting status\n",
+			       req->rq_disk->disk_name, err);
+			return err;
+		}
+		/*
+		 * Some cards mishandle the status bits,
+		 * so make sure to check both the busy
+		 * indication and the card state.
+		 */
+	} while (!(cmd.resp[0] & R1_READY_FOR_DATA) ||
+		(R1_CURRENT_STATE(cmd.resp[0]) == 7));
+
+	return 0;
+}
+
+/*
+ * Called by the core once an asynchronous request has completed, before
+ * the next one is issued. Anything other than a clean, complete transfer
+ * is handed back so that mmc_blk_issue_sync() can redo it.
+ */
+static int mmc_blk_err_check(struct mmc_card *card,
+			     struct mmc_async_req *areq)
+{
+	struct mmc_queue_req *mqrq = container_of(areq, struct mmc_queue_req,
+						  mmc_active);
+	struct mmc_blk_request *brq = &mqrq->brq;
+	struct request *req = mqrq->req;
+	unsigned int bytes;
+	int err = 0, ret;
+
+	if (mqrq->packed_num)
+		bytes = mqrq->packed_blocks << 9;
+	else
+		bytes = blk_rq_bytes(req);
+
+	if (brq->sbc.error || brq->cmd.error || brq->data.error ||
+	    brq->stop.error || brq->data.bytes_xfered != bytes)
+		err = -EIO;
+
+	/*
+	 * A failed write may still leave the card programming; wait for it
+	 * before the retry or the next request is sent.
+	 */
+	if (!mmc_host_is_spi(card->host) && rq_data_dir(req) != READ) {
+		ret = mmc_blk_wait_for_ready(card, req);
+		if (!err)
+			err = ret;
 	}
-#endif
 
-	mmc_claim_host(card->host);
+	return err;
+}
 
-	do {
-		struct mmc_command cmd;
-		u32 readcmd, writecmd, status = 0;
-
-		memset(&brq, 0, sizeof(struct mmc_blk_request));
-		brq.mrq.cmd = &brq.cmd;
-		brq.mrq.data = &brq.data;
-
-		brq.cmd.arg = blk_rq_pos(req);
-		if (!mmc_card_blockaddr(card))
-			brq.cmd.arg <<= 9;
-		brq.cmd.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
-		brq.data.blksz = 512;
-		brq.stop.opcode = MMC_STOP_TRANSMISSION;
-		brq.stop.arg = 0;
-		brq.stop.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
-		brq.data.blocks = blk_rq_sectors(req);
+static void mmc_blk_rw_rq_prep(struct mmc_queue_req *mqrq,
+			       struct mmc_card *card, int disable_multi,
+			       struct mmc_queue *mq)
+{
+	struct mmc_blk_request *brq = &mqrq->brq;
+	struct request *req = mqrq->req;
+	u32 readcmd, writecmd;
+
+	memset(brq, 0, sizeof(struct mmc_blk_request));
+	brq->mrq.cmd = &brq->cmd;
+	brq->mrq.data = &brq->data;
+
+	brq->cmd.arg = blk_rq_pos(req);
+	if (!mmc_card_blockaddr(card))
+		brq->cmd.arg <<= 9;
+	brq->cmd.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+	brq->data.blksz = 512;
+	brq->stop.opcode = MMC_STOP_TRANSMISSION;
+	brq->stop.arg = 0;
+	brq->stop.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+	brq->data.blocks = blk_rq_sectors(req);
 
-		/*
-		 * The block layer doesn't support all sector count
-		 * restrictions, so we need to be prepared for too big
-		 * requests.
-		 */
-		if (brq.data.blocks > card->host->max_blk_count)
-			brq.data.blocks = card->host->max_blk_count;
+	/*
+	 * The block layer doesn't support all sector count
+	 * restrictions, so we need to be prepared for too big
+	 * requests.
+	 */
+	if (brq->data.blocks > card->host->max_blk_count)
+		brq->data.blocks = card->host->max_blk_count;
 
-		/*
-		 * After a read error, we redo the request one sector at a time
-		 * in order to accurately determine which sectors can be read
-		 * successfully.
+	/*
+	 * After a read error, we redo the request one sector at a time
+	 * in order to accurately determine which sectors can be read
+	 * successfully.
+	 */
+	if (disable_multi && brq->data.blocks > 1)
+		brq->data.blocks = 1;
+
+	if (brq->data.blocks > 1) {
+		/* SPI multiblock writes terminate using a special
+		 * token, not a STOP_TRANSMISSION request.
 		 */
-		if (disable_multi && brq.data.blocks > 1)
-			brq.data.blocks = 1;
-
-		if (brq.data.blocks > 1) {
-			/* SPI multiblock writes terminate using a special
-			 * token, not a STOP_TRANSMISSION request.
-			 */
-			if (!mmc_host_is_spi(card->host)
-					|| rq_data_dir(req) == READ)
-				brq.mrq.stop = &brq.stop;
-			readcmd = MMC_READ_MULTIPLE_BLOCK;
-			writecmd = MMC_WRITE_MULTIPLE_BLOCK;
-		} else {
-			brq.mrq.stop = NULL;
-			readcmd = MMC_READ_SINGLE_BLOCK;
-			writecmd = MMC_WRITE_BLOCK;
-		}
+		if (!mmc_host_is_spi(card->host)
+				|| rq_data_dir(req) == READ)
+			brq->mrq.stop = &brq->stop;
+		readcmd = MMC_READ_MULTIPLE_BLOCK;
+		writecmd = MMC_WRITE_MULTIPLE_BLOCK;
+	} else {
+		brq->mrq.stop = NULL;
+		readcmd = MMC_READ_SINGLE_BLOCK;
+		writecmd = MMC_WRITE_BLOCK;
+	}
 
-		if (rq_data_dir(req) == READ) {
-			brq.cmd.opcode = readcmd;
-			brq.data.flags |= MMC_DATA_READ;
-		} else {
-			brq.cmd.opcode = writecmd;
-			brq.data.flags |= MMC_DATA_WRITE;
-		}
+	if (rq_data_dir(req) == READ) {
+		brq->cmd.opcode = readcmd;
+		brq->data.flags |= MMC_DATA_READ;
+	} else {
+		brq->cmd.opcode = writecmd;
+		brq->data.flags |= MMC_DATA_WRITE;
+	}
 
-		mmc_set_data_timeout(&brq.data, card);
+	mmc_set_data_timeout(&brq->data, card);
 
-		brq.data.sg = mq->sg;
-		brq.data.sg_len = mmc_queue_map_sg(mq);
+	brq->data.sg = mqrq->sg;
+	brq->data.sg_len = mmc_queue_map_sg(mq, mqrq);
 
-		/*
-		 * Adjust the sg list so it is the same size as the
-		 * request.
-		 */
-		if (brq.data.blocks != blk_rq_sectors(req)) {
-			int i, data_size = brq.data.blocks << 9;
-			struct scatterlist *sg;
-
-			for_each_sg(brq.data.sg, sg, brq.data.sg_len, i) {
-				data_size -= sg->length;
-				if (data_size <= 0) {
-					sg->length += data_size;
-					i++;
-					break;
-				}
+	/*
+	 * Adjust the sg list so it is the same size as the
+	 * request.
+	 */
+	if (brq->data.blocks != blk_rq_sectors(req)) {
+		int i, data_size = brq->data.blocks << 9;
+		struct scatterlist *sg;
+
+		for_each_sg(brq->data.sg, sg, brq->data.sg_len, i) {
+			data_size -= sg->length;
+			if (data_size <= 0) {
+				sg->length += data_size;
+				i++;
+				break;
 			}
-			brq.data.sg_len = i;
 		}
+		brq->data.sg_len = i;
+	}
+
+	mqrq->mmc_active.mrq = &brq->mrq;
+	mqrq->mmc_active.err_check = mmc_blk_err_check;
+
+	mmc_queue_bounce_pre(mqrq);
+}
+
+static void mmc_blk_account(struct mmc_blk_data *md, struct request *req)
+{
+	unsigned int bucket;
 
-		mmc_queue_bounce_pre(mq);
+	bucket = ilog2(max_t(unsigned int, blk_rq_sectors(req), 1));
+	if (bucket >= MMC_BLK_SIZE_BUCKETS)
+		bucket = MMC_BLK_SIZE_BUCKETS - 1;
 
-		mmc_wait_for_req(card->host, &brq.mrq);
+	if (rq_data_dir(req) == READ)
+		md->stats.rd_size[bucket]++;
+	else
+		md->stats.wr_size[bucket]++;
+}
 
-		mmc_queue_bounce_post(mq);
+static inline int mmc_blk_packable(struct request *req)
+{
+	return rq_data_dir(req) == WRITE && !blk_fua_rq(req) &&
+	       !blk_barrier_rq(req);
+}
+
+/*
+ * Takes the writes queued behind @mqrq->req off the queue for as long as
+ * they fit in one packed write, so that a burst of small writes costs
+ * the card a single command and programming cycle. Returns the number
+ * of requests gathered, @mqrq->req included.
+ */
+static unsigned int mmc_blk_packed_gather(struct mmc_queue *mq,
+					  struct mmc_queue_req *mqrq)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_card *card = md->queue.card;
+	struct mmc_host *host = card->host;
+	struct request_queue *q = mq->queue;
+	struct request *req = mqrq->req;
+	struct request *next;
+	unsigned int max_num, max_blocks, max_segs;
+	unsigned int num = 1, blocks, segs;
+
+	if (!md->packed_wr || !mqrq->packed_cmd_hdr || !mmc_blk_packable(req))
+		return 1;
+
+	max_num = min_t(unsigned int, card->ext_csd.max_packed_writes,
+			MMC_PACKED_MAX_NUM);
+	max_blocks = min(host->max_blk_count, host->max_req_size >> 9);
+	max_segs = min(host->max_hw_segs, host->max_phys_segs);
+
+	/* one block and one segment go to the header */
+	blocks = 1 + blk_rq_sectors(req);
+	segs = 1 + req->nr_phys_segments;
+	if (blocks > max_blocks || segs > max_segs)
+		return 1;
+
+	spin_lock_irq(q->queue_lock);
+	while (num < max_num && !blk_queue_plugged(q)) {
+		next = blk_peek_request(q);
+		if (!next || !mmc_blk_packable(next))
+			break;
+		if (blocks + blk_rq_sectors(next) > max_blocks ||
+		    segs + next->nr_phys_segments > max_segs)
+			break;
+
+		blk_start_request(next);
+		if (num == 1)
+			list_add_tail(&req->queuelist, &mqrq->packed_list);
+		list_add_tail(&next->queuelist, &mqrq->packed_list);
+		blocks += blk_rq_sectors(next);
+		segs += next->nr_phys_segments;
+		num++;
+	}
+	spin_unlock_irq(q->queue_lock);
+
+	if (num > 1) {
+		list_for_each_entry(next, &mqrq->packed_list, queuelist)
+			if (next != req)
+				mmc_blk_account(md, next);
+		mqrq->packed_num = num;
+		mqrq->packed_blocks = blocks;
+		md->stats.packed_cmds++;
+		md->stats.packed_reqs += num;
+	}
+
+	return num;
+}
+
+/*
+ * Builds one CMD23/CMD25 transfer out of the requests gathered on
+ * @mqrq->packed_list. The card finds their addresses and lengths in the
+ * header block that leads the data.
+ */
+static void mmc_blk_packed_rq_prep(struct mmc_queue_req *mqrq,
+				   struct mmc_card *card,
+				   struct mmc_queue *mq)
+{
+	struct mmc_blk_request *brq = &mqrq->brq;
+	u32 *hdr = mqrq->packed_cmd_hdr;
+	struct request *prq;
+	int i = 1;
+
+	memset(hdr, 0, MMC_PACKED_HDR_SZ);
+	hdr[0] = cpu_to_le32((mqrq->packed_num << 16) |
+			     (MMC_PACKED_CMD_WR << 8) | MMC_PACKED_CMD_VER);
+	list_for_each_entry(prq, &mqrq->packed_list, queuelist) {
+		hdr[i * 2] = cpu_to_le32(blk_rq_sectors(prq));
+		hdr[i * 2 + 1] = cpu_to_le32(mmc_card_blockaddr(card) ?
+					     blk_rq_pos(prq) :
+					     blk_rq_pos(prq) << 9);
+		i++;
+	}
+
+	memset(brq, 0, sizeof(struct mmc_blk_request));
+	brq->mrq.sbc = &brq->sbc;
+	brq->mrq.cmd = &brq->cmd;
+	brq->mrq.data = &brq->data;
+
+	/* the block count ends the transfer, so there is no stop command */
+	brq->sbc.opcode = MMC_SET_BLOCK_COUNT;
+	brq->sbc.arg = MMC_CMD23_ARG_PACKED | mqrq->packed_blocks;
+	brq->sbc.flags = MMC_RSP_R1 | MMC_CMD_AC;
+
+	brq->cmd.opcode = MMC_WRITE_MULTIPLE_BLOCK;
+	brq->cmd.arg = blk_rq_pos(mqrq->req);
+	if (!mmc_card_blockaddr(card))
+		brq->cmd.arg <<= 9;
+	brq->cmd.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+
+	brq->data.blksz = 512;
+	brq->data.blocks = mqrq->packed_blocks;
+	brq->data.flags = MMC_DATA_WRITE;
+	mmc_set_data_timeout(&brq->data, card);
+
+	brq->data.sg = mqrq->sg;
+	brq->data.sg_len = mmc_queue_packed_map_sg(mq, mqrq);
+
+	mqrq->mmc_active.mrq = &brq->mrq;
+	mqrq->mmc_active.err_check = mmc_blk_err_check;
+}
+
+static void mmc_blk_packed_end(struct mmc_blk_data *md,
+			       struct mmc_queue_req *mqrq)
+{
+	struct request *prq, *tmp;
+
+	spin_lock_irq(&md->lock);
+	list_for_each_entry_safe(prq, tmp, &mqrq->packed_list, queuelist) {
+		list_del_init(&prq->queuelist);
+		__blk_end_request_all(prq, 0);
+	}
+	spin_unlock_irq(&md->lock);
+
+	mqrq->packed_num = 0;
+}
+
+/*
+ * Issues what is left of a request synchronously, one transfer at a
+ * time, with the single-block read retry and partial write accounting
+ * used on errors. Nothing may be in flight on the host.
+ */
+static int mmc_blk_issue_sync(struct mmc_queue *mq, struct mmc_queue_req *mqrq)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_card *card = md->queue.card;
+	struct mmc_blk_request *brq = &mqrq->brq;
+	struct request *req = mqrq->req;
+	int ret = 1, disable_multi = 0;
+
+	do {
+		u32 status = 0;
+
+		mmc_blk_rw_rq_prep(mqrq, card, disable_multi, mq);
+
+		mmc_wait_for_req(card->host, &brq->mrq);
+
+		mmc_queue_bounce_post(mqrq);
 
 		/*
 		 * Check for errors here, but don't jump to cmd_err
 		 * until later as we need to wait for the card to leave
 		 * programming mode even when things go wrong.
 		 */
-		if (brq.cmd.error || brq.data.error || brq.stop.error) {
-			if (brq.data.blocks > 1 && rq_data_dir(req) == READ) {
+		if (brq->cmd.error || brq->data.error || brq->stop.error) {
+			if (brq->data.blocks > 1 && rq_data_dir(req) == READ) {
 				/* Redo read one sector at a time */
 				printk(KERN_WARNING "%s: retrying using single "
 				       "block read\n", req->rq_disk->disk_name);
@@ -389,62 +632,37 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 			disable_multi = 0;
 		}
 
-		if (brq.cmd.error) {
+		if (brq->cmd.error) {
 			printk(KERN_ERR "%s: error %d sending read/write "
 			       "command, response %#x, card status %#x\n",
-			       req->rq_disk->disk_name, brq.cmd.error,
-			       brq.cmd.resp[0], status);
+			       req->rq_disk->disk_name, brq->cmd.error,
+			       brq->cmd.resp[0], status);
 		}
 
-		if (brq.data.error) {
-			if (brq.data.error == -ETIMEDOUT && brq.mrq.stop)
+		if (brq->data.error) {
+			if (brq->data.error == -ETIMEDOUT && brq->mrq.stop)
 				/* 'Stop' response contains card status */
-				status = brq.mrq.stop->resp[0];
+				status = brq->mrq.stop->resp[0];
 			printk(KERN_ERR "%s: error %d transferring data,"
 			       " sector %u, nr %u, card status %#x\n",
-			       req->rq_disk->disk_name, brq.data.error,
+			       req->rq_disk->disk_name, brq->data.error,
 			       (unsigned)blk_rq_pos(req),
 			       (unsigned)blk_rq_sectors(req), status);
 		}
 
-		if (brq.stop.error) {
+		if (brq->stop.error) {
 			printk(KERN_ERR "%s: error %d sending stop command, "
 			       "response %#x, card status %#x\n",
-			       req->rq_disk->disk_name, brq.stop.error,
-			       brq.stop.resp[0], status);
+			       req->rq_disk->disk_name, brq->stop.error,
+			       brq->stop.resp[0], status);
 		}
 
 		if (!mmc_host_is_spi(card->host) && rq_data_dir(req) != READ) {
-			do {
-				int err;
-
-				cmd.opcode = MMC_SEND_STATUS;
-				cmd.arg = card->rca << 16;
-				cmd.flags = MMC_RSP_R1 | MMC_CMD_AC;
-				err = mmc_wait_for_cmd(card->host, &cmd, 5);
-				if (err) {
-					printk(KERN_ERR "%s: error %d requesting status\n",
-					       req->rq_disk->disk_name, err);
-					goto cmd_err;
-				}
-				/*
-				 * Some cards mishandle the status bits,
-				 * so make sure to check both the busy
-				 * indication and the card state.
-				 */
-			} while (!(cmd.resp[0] & R1_READY_FOR_DATA) ||
-				(R1_CURRENT_STATE(cmd.resp[0]) == 7));
-
-#if 0
-			if (cmd.resp[0] & ~0x00000900)
-				printk(KERN_ERR "%s: status = %08x\n",
-				       req->rq_disk->disk_name, cmd.resp[0]);
-			if (mmc_decode_status(cmd.resp))
+			if (mmc_blk_wait_for_ready(card, req))
 				goto cmd_err;
-#endif
 		}
 
-		if (brq.cmd.error || brq.stop.error || brq.data.error) {
+		if (brq->cmd.error || brq->stop.error || brq->data.error) {
 			if (rq_data_dir(req) == READ) {
 				/*
 				 * After an error, we redo I/O one sector at a
@@ -452,7 +670,7 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 				 * read a single sector.
 				 */
 				spin_lock_irq(&md->lock);
-				ret = __blk_end_request(req, -EIO, brq.data.blksz);
+				ret = __blk_end_request(req, -EIO, brq->data.blksz);
 				spin_unlock_irq(&md->lock);
 				continue;
 			}
@@ -463,12 +681,10 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 		 * A block was successfully transferred.
 		 */
 		spin_lock_irq(&md->lock);
-		ret = __blk_end_request(req, 0, brq.data.bytes_xfered);
+		ret = __blk_end_request(req, 0, brq->data.bytes_xfered);
 		spin_unlock_irq(&md->lock);
 	} while (ret);
 
-	mmc_release_host(card->host);
-
 	return 1;
 
  cmd_err:
@@ -491,12 +707,10 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 		}
 	} else {
 		spin_lock_irq(&md->lock);
-		ret = __blk_end_request(req, 0, brq.data.bytes_xfered);
+		ret = __blk_end_request(req, 0, brq->data.bytes_xfered);
 		spin_unlock_irq(&md->lock);
 	}
 
-	mmc_release_host(card->host);
-
 	spin_lock_irq(&md->lock);
 	while (ret)
 		ret = __blk_end_request(req, -EIO, blk_rq_cur_bytes(req));
@@ -505,6 +719,185 @@ static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
 	return 0;
 }
 
+/*
+ * A packed write failed. Stop the card if it is still receiving and redo
+ * each request on its own; rewriting the parts that did make it is
+ * harmless. A card that turned down the command itself gets no more
+ * packed writes. Nothing may be in flight on the host.
+ */
+static int mmc_blk_packed_redo(struct mmc_queue *mq,
+			       struct mmc_queue_req *mqrq)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_card *card = md->queue.card;
+	struct mmc_blk_request *brq = &mqrq->brq;
+	struct mmc_command cmd;
+	struct request *prq, *tmp;
+	int ret = 1;
+
+	md->stats.packed_fails++;
+
+	if (brq->sbc.error || brq->cmd.error) {
+		printk(KERN_WARNING "%s: packed write failed (%d/%d), "
+		       "disabling packed writes\n", md->disk->disk_name,
+		       brq->sbc.error, brq->cmd.error);
+		md->packed_wr = 0;
+	} else if (brq->data.error) {
+		memset(&cmd, 0, sizeof(struct mmc_command));
+		cmd.opcode = MMC_STOP_TRANSMISSION;
+		cmd.flags = MMC_RSP_R1B | MMC_CMD_AC;
+		mmc_wait_for_cmd(card->host, &cmd, 0);
+	}
+	mmc_blk_wait_for_ready(card, mqrq->req);
+
+	mqrq->packed_num = 0;
+	list_for_each_entry_safe(prq, tmp, &mqrq->packed_list, queuelist) {
+		list_del_init(&prq->queuelist);
+		mqrq->req = prq;
+		if (!mmc_blk_issue_sync(mq, mqrq))
+			ret = 0;
+	}
+
+	return ret;
+}
+
+/*
+ * Starts @rqc, if any, and completes the request that was in flight
+ * before it. A request that needs more than one transfer is not
+ * pipelined: the one in flight is drained first and it is then issued
+ * synchronously.
+ */
+static int mmc_blk_issue_rw_rq(struct mmc_queue *mq, struct request *rqc)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_card *card = md->queue.card;
+	struct mmc_queue_req *cur = NULL;
+	struct mmc_queue_req *mqrq;
+	struct mmc_async_req *areq;
+	int err, ret = 1;
+
+	if (rqc)
+		mmc_blk_account(md, rqc);
+
+	if (rqc && blk_rq_sectors(rqc) <= card->host->max_blk_count) {
+		cur = mq->mqrq_cur;
+		if (mmc_blk_packed_gather(mq, cur) > 1)
+			mmc_blk_packed_rq_prep(cur, card, mq);
+		else
+			mmc_blk_rw_rq_prep(cur, card, 0, mq);
+	}
+
+	areq = mmc_start_req(card->host, cur ? &cur->mmc_active : NULL, &err);
+	if (areq) {
+		mqrq = container_of(areq, struct mmc_queue_req, mmc_active);
+		if (!err && mqrq->packed_num) {
+			mmc_blk_packed_end(md, mqrq);
+		} else if (!err) {
+			mmc_queue_bounce_post(mqrq);
+			spin_lock_irq(&md->lock);
+			__blk_end_request(mqrq->req, 0,
+					  mqrq->brq.data.bytes_xfered);
+			spin_unlock_irq(&md->lock);
+		} else {
+			/* @cur was not started; the host is idle */
+			if (mqrq->packed_num)
+				ret = mmc_blk_packed_redo(mq, mqrq);
+			else
+				ret = mmc_blk_issue_sync(mq, mqrq);
+			if (cur)
+				mmc_start_req(card->host, &cur->mmc_active,
+					      NULL);
+		}
+	}
+
+	if (rqc && !cur)
+		ret = mmc_blk_issue_sync(mq, mq->mqrq_cur);
+
+	return ret;
+}
+
+static int mmc_blk_issue_rq(struct mmc_queue *mq, struct request *req)
+{
+	struct mmc_blk_data *md = mq->data;
+	struct mmc_card *card = md->queue.card;
+	int ret;
+
+	/* the host stays claimed for as long as requests are in flight */
+	if (req && !mq->mqrq_prev->req) {
+#ifdef CONFIG_MMC_BLOCK_DEFERRED_RESUME
+		if (mmc_bus_needs_resume(card->host)) {
+			mmc_resume_bus(card->host);
+			mmc_blk_set_blksize(md, card);
+		}
+#endif
+		mmc_claim_host(card->host);
+	}
+
+	ret = mmc_blk_issue_rw_rq(mq, req);
+
+	if (!req)
+		mmc_release_host(card->host);
+
+	return ret;
+}
+
+
+#ifdef CONFIG_DEBUG_FS
+
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+static struct dentry *mmc_blk_debugfs_root;
+
+static int mmc_blk_stats_show(struct seq_file *s, void *unused)
+{
+	struct mmc_blk_data *md = s->private;
+	struct mmc_blk_stats *st = &md->stats;
+	int i;
+
+	seq_printf(s, "%-8s %10s %10s\n", "sectors", "reads", "writes");
+	for (i = 0; i < MMC_BLK_SIZE_BUCKETS; i++)
+		seq_printf(s, "%7u%c %10lu %10lu\n", 1 << i,
+			   i == MMC_BLK_SIZE_BUCKETS - 1 ? '+' : ' ',
+			   st->rd_size[i], st->wr_size[i]);
+
+	seq_printf(s, "\npacked writes: %s\n",
+		   md->packed_wr ? "enabled" : "disabled");
+	seq_printf(s, "packed cmds:   %lu\n", st->packed_cmds);
+	seq_printf(s, "packed reqs:   %lu\n", st->packed_reqs);
+	seq_printf(s, "packed fails:  %lu\n", st->packed_fails);
+
+	return 0;
+}
+
+static int mmc_blk_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mmc_blk_stats_show, inode->i_private);
+}
+
+static const struct file_operations mmc_blk_stats_fops = {
+	.open		= mmc_blk_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void mmc_blk_add_debugfs(struct mmc_blk_data *md)
+{
+	md->debugfs_stats = debugfs_create_file(md->disk->disk_name, S_IRUSR,
+						mmc_blk_debugfs_root, md,
+						&mmc_blk_stats_fops);
+}
+
+static void mmc_blk_remove_debugfs(struct mmc_blk_data *md)
+{
+	debugfs_remove(md->debugfs_stats);
+	md->debugfs_stats = NULL;
+}
+#else
+static inline void mmc_blk_add_debugfs(struct mmc_blk_data *md) { }
+static inline void mmc_blk_remove_debugfs(struct mmc_blk_data *md) { }
+#endif
 
 static inline int mmc_blk_readonly(struct mmc_card *card)
 {
@@ -569,6 +962,7 @@ static struct mmc_blk_data *mmc_blk_alloc(struct mmc_card *card)
 
 	md->queue.issue_fn = mmc_blk_issue_rq;
 	md->queue.data = md;
+	md->packed_wr = md->queue.mqrq_cur->packed_cmd_hdr != NULL;
 
 	md->disk->major	= MMC_BLOCK_MAJOR;
 	md->disk->first_minor = devidx << MMC_SHIFT;
@@ -649,6 +1043,7 @@ static int mmc_blk_probe(struct mmc_card *card)
 	mmc_set_bus_resume_policy(card->host, 1);
 #endif
 	add_disk(md->disk);
+	mmc_blk_add_debugfs(md);
 	return 0;
 
  out:
@@ -663,6 +1058,8 @@ static void mmc_blk_remove(struct mmc_card *card)
 	struct mmc_blk_data *md = mmc_get_drvdata(card);
 
 	if (md) {
+		mmc_blk_remove_debugfs(md);
+
 		/* Stop new requests from getting into the queue */
 		del_gendisk(md->disk);
 
@@ -723,12 +1120,19 @@ static int __init mmc_blk_init(void)
 	if (res)
 		goto out;
 
+#ifdef CONFIG_DEBUG_FS
+	mmc_blk_debugfs_root = debugfs_create_dir("mmcblk", NULL);
+#endif
+
 	res = mmc_register_driver(&mmc_driver);
 	if (res)
 		goto out2;
 
 	return 0;
  out2:
+#ifdef CONFIG_DEBUG_FS
+	debugfs_remove(mmc_blk_debugfs_root);
+#endif
 	unregister_blkdev(MMC_BLOCK_MAJOR, "mmc");
  out:
 	return res;
@@ -737,6 +1141,9 @@ static int __init mmc_blk_init(void)
 static void __exit mmc_blk_exit(void)
 {
 	mmc_unregister_driver(&mmc_driver);
+#ifdef CONFIG_DEBUG_FS
+	debugfs_remove(mmc_blk_debugfs_root);
+#endif
 	unregister_blkdev(MMC_BLOCK_MAJOR, "mmc");
 }
 
@@ -891,6 +891,120 @@ static int mmc_test_multi_read_high(struct mmc_test_card *test)
 
 #endif /* CONFIG_HIGHMEM */
 
+/*
+ * Writes two separate ranges with one eMMC 4.5 packed write command and
+ * checks them, and the sector between them, by reading back sector by
+ * sector. The first block of the transfer is the packed command header.
+ */
+static int mmc_test_packed_write(struct mmc_test_card *test)
+{
+	static const unsigned start[2] = { 1, 4 }, count[2] = { 2, 3 };
+	struct mmc_card *card = test->card;
+	struct mmc_request mrq;
+	struct mmc_command sbc;
+	struct mmc_command cmd;
+	struct mmc_data data;
+	struct scatterlist sg;
+	u32 *hdr = (u32 *)test->buffer;
+	unsigned blocks, sector, i, j;
+	u8 *p;
+	int ret;
+
+	if (!mmc_card_mmc(card) || card->ext_csd.max_packed_writes < 2)
+		return RESULT_UNSUP_CARD;
+
+	blocks = 1 + count[0] + count[1];
+	if (mmc_host_is_spi(card->host) ||
+	    card->host->max_blk_count < blocks ||
+	    card->host->max_req_size < blocks * 512 ||
+	    card->host->max_seg_size < blocks * 512)
+		return RESULT_UNSUP_HOST;
+
+	ret = mmc_test_set_blksize(test, 512);
+	if (ret)
+		return ret;
+
+	/* mark the test area so stray writes show up */
+	memset(test->buffer, 0xDF, 512);
+	for (sector = 0; sector < 8; sector++) {
+		ret = mmc_test_buffer_transfer(test, test->buffer,
+			mmc_card_blockaddr(card) ? sector : sector << 9,
+			512, 1);
+		if (ret)
+			return ret;
+	}
+
+	memset(hdr, 0, 512);
+	hdr[0] = cpu_to_le32((2 << 16) | (MMC_PACKED_CMD_WR << 8) |
+			     MMC_PACKED_CMD_VER);
+	for (i = 0; i < 2; i++) {
+		hdr[(i + 1) * 2] = cpu_to_le32(count[i]);
+		hdr[(i + 1) * 2 + 1] = cpu_to_le32(mmc_card_blockaddr(card) ?
+						   start[i] : start[i] << 9);
+	}
+	for (i = 0; i < (blocks - 1) * 512; i++)
+		test->buffer[512 + i] = i;
+
+	memset(&mrq, 0, sizeof(struct mmc_request));
+	memset(&sbc, 0, sizeof(struct mmc_command));
+	memset(&cmd, 0, sizeof(struct mmc_command));
+	memset(&data, 0, sizeof(struct mmc_data));
+
+	mrq.sbc = &sbc;
+	mrq.cmd = &cmd;
+	mrq.data = &data;
+
+	sbc.opcode = MMC_SET_BLOCK_COUNT;
+	sbc.arg = MMC_CMD23_ARG_PACKED | blocks;
+	sbc.flags = MMC_RSP_R1 | MMC_CMD_AC;
+
+	cmd.opcode = MMC_WRITE_MULTIPLE_BLOCK;
+	cmd.arg = mmc_card_blockaddr(card) ? start[0] : start[0] << 9;
+	cmd.flags = MMC_RSP_R1 | MMC_CMD_ADTC;
+
+	sg_init_one(&sg, test->buffer, blocks * 512);
+	data.blksz = 512;
+	data.blocks = blocks;
+	data.flags = MMC_DATA_WRITE;
+	data.sg = &sg;
+	data.sg_len = 1;
+	mmc_set_data_timeout(&data, card);
+
+	mmc_wait_for_req(card->host, &mrq);
+
+	mmc_test_wait_busy(test);
+
+	if (sbc.error)
+		return sbc.error == -EINVAL ? RESULT_UNSUP_HOST : sbc.error;
+	ret = mmc_test_check_result(test, &mrq);
+	if (ret)
+		return ret;
+
+	/* sectors 1-2 and 4-6 carry the pattern, 0, 3 and 7 are untouched */
+	j = 0;
+	for (sector = 0; sector < 8; sector++) {
+		ret = mmc_test_buffer_transfer(test, test->buffer,
+			mmc_card_blockaddr(card) ? sector : sector << 9,
+			512, 0);
+		if (ret)
+			return ret;
+
+		p = test->buffer;
+		if ((sector >= start[0] && sector < start[0] + count[0]) ||
+		    (sector >= start[1] && sector < start[1] + count[1])) {
+			for (i = 0; i < 512; i++, j++)
+				if (p[i] != (u8)j)
+					return RESULT_FAIL;
+		} else {
+			for (i = 0; i < 512; i++)
+				if (p[i] != 0xDF)
+					return RESULT_FAIL;
+		}
+	}
+
+	return 0;
+}
+
 static const struct mmc_test_case mmc_test_cases[] = {
 	{
 		.name = "Basic write (no data verification)",
@@ -1038,6 +1152,12 @@ static const struct mmc_test_case mmc_test_cases[] = {
 
 #endif /* CONFIG_HIGHMEM */
 
+	{
+		.name = "Packed write",
+		.run = mmc_test_packed_write,
+		.cleanup = mmc_test_cleanup,
+	},
+
 };
 
 static DEFINE_MUTEX(mmc_test_lock);
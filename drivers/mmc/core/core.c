@@ -186,6 +186,27 @@ static void mmc_wait_done(struct mmc_request *mrq)
 	complete(mrq->done_data);
 }
 
+/*
+ * Sends the SET_BLOCK_COUNT command of @mrq, if it has one. Hosts here
+ * know nothing of CMD23, so it goes out as a command of its own right
+ * before the request it belongs to. If it fails, the request is not
+ * started and the error is reported in mrq->cmd as well, for callers
+ * which do not look at mrq->sbc.
+ */
+static int mmc_send_sbc(struct mmc_host *host, struct mmc_request *mrq)
+{
+	int err;
+
+	if (!mrq->sbc)
+		return 0;
+
+	err = mmc_wait_for_cmd(host, mrq->sbc, 0);
+	if (err)
+		mrq->cmd->error = err;
+
+	return err;
+}
+
 /**
  *	mmc_wait_for_req - start a request and wait for completion
  *	@host: MMC host to start command
@@ -202,6 +223,13 @@ void mmc_wait_for_req(struct mmc_host *host, struct mmc_request *mrq)
 	mrq->done_data = &complete;
 	mrq->done = mmc_wait_done;
 
+	/* not prepared through pre_req */
+	if (mrq->data)
+		mrq->data->host_cookie = 0;
+
+	if (mmc_send_sbc(host, mrq))
+		return;
+
 	mmc_start_request(host, mrq);
 
 	wait_for_completion(&complete);
@@ -209,6 +237,82 @@ void mmc_wait_for_req(struct mmc_host *host, struct mmc_request *mrq)
 
 EXPORT_SYMBOL(mmc_wait_for_req);
 
+static void mmc_pre_req(struct mmc_host *host, struct mmc_request *mrq,
+		 bool is_first_req)
+{
+	if (host->ops->pre_req)
+		host->ops->pre_req(host, mrq, is_first_req);
+}
+
+static void mmc_post_req(struct mmc_host *host, struct mmc_request *mrq,
+			 int err)
+{
+	if (host->ops->post_req)
+		host->ops->post_req(host, mrq, err);
+}
+
+/**
+ *	mmc_start_req - start a request without waiting for it
+ *	@host: MMC host to start the request on
+ *	@areq: async request to start, or NULL to only wait
+ *	@error: where to store the result of the previous request
+ *
+ *	Prepares @areq with the host's pre_req hook, then waits for the
+ *	request started by the previous call, if any, and runs its
+ *	err_check. If that succeeded @areq is issued and the previous
+ *	request is finished with post_req, so the preparation of one
+ *	request overlaps the transfer of the other. If it failed, @areq is
+ *	not issued and the caller gets the error back in @error; it must
+ *	handle the failed request and start @areq again.
+ *
+ *	Returns the previous request, or NULL if there was none.
+ */
+struct mmc_async_req *mmc_start_req(struct mmc_host *host,
+				    struct mmc_async_req *areq, int *error)
+{
+	struct mmc_async_req *prev = host->areq;
+	int err = 0;
+
+	if (areq) {
+		if (areq->mrq->data)
+			areq->mrq->data->host_cookie = 0;
+		mmc_pre_req(host, areq->mrq, !prev);
+	}
+
+	if (prev) {
+		wait_for_completion(&prev->complete);
+		err = prev->err_check(host->card, prev);
+		if (err) {
+			mmc_post_req(host, prev->mrq, 0);
+			if (areq)
+				mmc_post_req(host, areq->mrq, -EINVAL);
+			host->areq = NULL;
+			goto out;
+		}
+	}
+
+	if (areq) {
+		init_completion(&areq->complete);
+		areq->mrq->done_data = &areq->complete;
+		areq->mrq->done = mmc_wait_done;
+		/* a failed SET_BLOCK_COUNT is left to err_check */
+		if (mmc_send_sbc(host, areq->mrq))
+			complete(&areq->complete);
+		else
+			mmc_start_request(host, areq->mrq);
+	}
+
+	if (prev)
+		mmc_post_req(host, prev->mrq, 0);
+
+	host->areq = areq;
+out:
+	if (error)
+		*error = err;
+	return prev;
+}
+EXPORT_SYMBOL(mmc_start_req);
+
 /**
  *	mmc_wait_for_cmd - start a command and wait for completion
  *	@host: MMC host to start command
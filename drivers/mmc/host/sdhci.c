@@ -406,25 +406,24 @@ static int sdhci_adma_table_pre(struct sdhci_host *host,
 		direction = DMA_TO_DEVICE;
 
 	/*
-	 * The ADMA descriptor table is mapped further down as we
-	 * need to fill it with data first.
+	 * The descriptor table and the align buffer are coherent
+	 * allocations made once per host, so there is nothing to map
+	 * or sync for them here.
 	 */
 
-	host->align_addr = dma_map_single(mmc_dev(host->mmc),
-		host->align_buffer, 128 * 4, direction);
-	if (dma_mapping_error(mmc_dev(host->mmc), host->align_addr))
-		goto fail;
-	BUG_ON(host->align_addr & 0x3);
-
-	host->sg_count = dma_map_sg(mmc_dev(host->mmc),
-		data->sg, data->sg_len, direction);
+	if (data->host_cookie)
+		host->sg_count = data->host_cookie;
+	else
+		host->sg_count = dma_map_sg(mmc_dev(host->mmc),
+			data->sg, data->sg_len, direction);
 	if (host->sg_count == 0)
-		goto unmap_align;
+		return -EINVAL;
 
 	desc = host->adma_desc;
 	align = host->align_buffer;
 
 	align_addr = host->align_addr;
+	host->align_used = 0;
 
 	for_each_sg(data->sg, sg, host->sg_count, i) {
 		addr = sg_dma_address(sg);
@@ -461,6 +460,7 @@ static int sdhci_adma_table_pre(struct sdhci_host *host,
 
 			align += 4;
 			align_addr += 4;
+			host->align_used = 1;
 
 			desc += 8;
 
@@ -506,7 +506,7 @@ static int sdhci_adma_table_pre(struct sdhci_host *host,
 		 * If this triggers then we have a calculation bug
 		 * somewhere. :/
 		 */
-		WARN_ON((desc - host->adma_desc) > (128 * 2 + 1) * 4);
+		WARN_ON((desc - host->adma_desc) > SDHCI_ADMA_TABLE_SZ);
 	}
 
 	/*
@@ -523,30 +523,10 @@ static int sdhci_adma_table_pre(struct sdhci_host *host,
 	desc[1] = 0x00;
 	desc[0] = 0x03; /* nop, end, valid */
 
-	/*
-	 * Resync align buffer as we might have changed it.
-	 */
-	if (data->flags & MMC_DATA_WRITE) {
-		dma_sync_single_for_device(mmc_dev(host->mmc),
-			host->align_addr, 128 * 4, direction);
-	}
-
-	host->adma_addr = dma_map_single(mmc_dev(host->mmc),
-		host->adma_desc, (128 * 2 + 1) * 4, DMA_TO_DEVICE);
-	if (dma_mapping_error(mmc_dev(host->mmc), host->adma_addr))
-		goto unmap_entries;
-	BUG_ON(host->adma_addr & 0x3);
+	/* make sure the table is written before the controller reads it */
+	wmb();
 
 	return 0;
-
-unmap_entries:
-	dma_unmap_sg(mmc_dev(host->mmc), data->sg,
-		data->sg_len, direction);
-unmap_align:
-	dma_unmap_single(mmc_dev(host->mmc), host->align_addr,
-		128 * 4, direction);
-fail:
-	return -EINVAL;
 }
 
 static void sdhci_adma_table_post(struct sdhci_host *host,
@@ -565,13 +545,8 @@ static void sdhci_adma_table_post(struct sdhci_host *host,
 	else
 		direction = DMA_TO_DEVICE;
 
-	dma_unmap_single(mmc_dev(host->mmc), host->adma_addr,
-		(128 * 2 + 1) * 4, DMA_TO_DEVICE);
-
-	dma_unmap_single(mmc_dev(host->mmc), host->align_addr,
-		128 * 4, direction);
-
-	if (data->flags & MMC_DATA_READ) {
+	/* only unaligned reads have bytes waiting in the align buffer */
+	if (host->align_used && (data->flags & MMC_DATA_READ)) {
 		dma_sync_sg_for_cpu(mmc_dev(host->mmc), data->sg,
 			data->sg_len, direction);
 
@@ -591,8 +566,10 @@ static void sdhci_adma_table_post(struct sdhci_host *host,
 		}
 	}
 
-	dma_unmap_sg(mmc_dev(host->mmc), data->sg,
-		data->sg_len, direction);
+	/* pre-mapped scatterlists are unmapped in sdhci_post_req */
+	if (!data->host_cookie)
+		dma_unmap_sg(mmc_dev(host->mmc), data->sg,
+			data->sg_len, direction);
 }
 
 static u8 sdhci_calc_timeout(struct sdhci_host *host, struct mmc_data *data)
@@ -761,7 +738,10 @@ static void sdhci_prepare_data(struct sdhci_host *host, struct mmc_data *data)
 		} else {
 			int sg_cnt;
 
-			sg_cnt = dma_map_sg(mmc_dev(host->mmc),
+			if (data->host_cookie)
+				sg_cnt = data->host_cookie;
+			else
+				sg_cnt = dma_map_sg(mmc_dev(host->mmc),
 					data->sg, data->sg_len,
 					(data->flags & MMC_DATA_READ) ?
 						DMA_FROM_DEVICE :
@@ -837,6 +817,29 @@ static void sdhci_set_transfer_mode(struct sdhci_host *host,
 	sdhci_writew(host, mode, SDHCI_TRANSFER_MODE);
 }
 
+static bool sdhci_mrq_failed(struct mmc_request *mrq)
+{
+	return (mrq->cmd && mrq->cmd->error) ||
+		(mrq->data && (mrq->data->error ||
+		 (mrq->data->stop && mrq->data->stop->error)));
+}
+
+/*
+ * Called with the host lock held once the current request is over. A
+ * clean completion seen by sdhci_irq() is handed back to the core from
+ * there as soon as it drops the lock, which saves a pass through the
+ * finish tasklet. Errors still take the tasklet as the controller reset
+ * busy-waits and the core may retry the request.
+ */
+static void sdhci_request_done(struct sdhci_host *host)
+{
+	if (host->in_irq && !sdhci_mrq_failed(host->mrq) &&
+	    !(host->quirks & SDHCI_QUIRK_RESET_AFTER_REQUEST))
+		host->irq_finish = 1;
+	else
+		tasklet_schedule(&host->finish_tasklet);
+}
+
 static void sdhci_finish_data(struct sdhci_host *host)
 {
 	struct mmc_data *data;
@@ -849,7 +852,7 @@ static void sdhci_finish_data(struct sdhci_host *host)
 	if (host->flags & SDHCI_REQ_USE_DMA) {
 		if (host->flags & SDHCI_USE_ADMA)
 			sdhci_adma_table_post(host, data);
-		else {
+		else if (!data->host_cookie) {
 			dma_unmap_sg(mmc_dev(host->mmc), data->sg,
 				data->sg_len, (data->flags & MMC_DATA_READ) ?
 					DMA_FROM_DEVICE : DMA_TO_DEVICE);
@@ -880,7 +883,7 @@ static void sdhci_finish_data(struct sdhci_host *host)
 
 		sdhci_send_command(host, data->stop);
 	} else
-		tasklet_schedule(&host->finish_tasklet);
+		sdhci_request_done(host);
 }
 
 static void sdhci_send_command(struct sdhci_host *host, struct mmc_command *cmd)
@@ -909,7 +912,7 @@ static void sdhci_send_command(struct sdhci_host *host, struct mmc_command *cmd)
 				"inhibit bit(s).\n", mmc_hostname(host->mmc));
 			sdhci_dumpregs(host);
 			cmd->error = -EIO;
-			tasklet_schedule(&host->finish_tasklet);
+			sdhci_request_done(host);
 			return;
 		}
 		timeout--;
@@ -941,7 +944,7 @@ static void sdhci_send_command(struct sdhci_host *host, struct mmc_command *cmd)
 		printk(KERN_ERR "%s: Unsupported response type!\n",
 			mmc_hostname(host->mmc));
 		cmd->error = -EINVAL;
-		tasklet_schedule(&host->finish_tasklet);
+		sdhci_request_done(host);
 		return;
 	}
 
@@ -992,7 +995,7 @@ static void sdhci_finish_command(struct sdhci_host *host)
 		sdhci_finish_data(host);
 
 	if (!host->cmd->data)
-		tasklet_schedule(&host->finish_tasklet);
+		sdhci_request_done(host);
 
 	host->cmd = NULL;
 }
@@ -1146,7 +1149,7 @@ static void sdhci_request(struct mmc_host *mmc, struct mmc_request *mrq)
 
 	if (!present || host->flags & SDHCI_DEVICE_DEAD) {
 		host->mrq->cmd->error = -ENOMEDIUM;
-		tasklet_schedule(&host->finish_tasklet);
+		sdhci_request_done(host);
 	} else
 		sdhci_send_command(host, mrq->cmd);
 
@@ -1154,6 +1157,54 @@ static void sdhci_request(struct mmc_host *mmc, struct mmc_request *mrq)
 	spin_unlock_irqrestore(&host->lock, flags);
 }
 
+/*
+ * Maps the scatterlist of a request queued behind the one in flight, so
+ * that its cache maintenance overlaps the running transfer. The number
+ * of mapped entries is kept in host_cookie. Requests that might have to
+ * fall back to PIO, or need the ADMA align buffer, are left to
+ * sdhci_prepare_data as before.
+ */
+static void sdhci_pre_req(struct mmc_host *mmc, struct mmc_request *mrq,
+	bool is_first_req)
+{
+	struct sdhci_host *host = mmc_priv(mmc);
+	struct mmc_data *data = mrq->data;
+	struct scatterlist *sg;
+	int i;
+
+	if (!data)
+		return;
+
+	if (!(host->flags & (SDHCI_USE_SDMA | SDHCI_USE_ADMA)) ||
+	    (host->quirks & (SDHCI_QUIRK_32BIT_DMA_ADDR |
+			     SDHCI_QUIRK_32BIT_DMA_SIZE |
+			     SDHCI_QUIRK_32BIT_ADMA_SIZE)))
+		return;
+
+	for_each_sg(data->sg, sg, data->sg_len, i) {
+		if (sg->offset & 0x3)
+			return;
+	}
+
+	data->host_cookie = dma_map_sg(mmc_dev(mmc), data->sg, data->sg_len,
+		(data->flags & MMC_DATA_READ) ?
+			DMA_FROM_DEVICE : DMA_TO_DEVICE);
+}
+
+static void sdhci_post_req(struct mmc_host *mmc, struct mmc_request *mrq,
+	int err)
+{
+	struct mmc_data *data = mrq->data;
+
+	if (!data || !data->host_cookie)
+		return;
+
+	dma_unmap_sg(mmc_dev(mmc), data->sg, data->sg_len,
+		(data->flags & MMC_DATA_READ) ?
+			DMA_FROM_DEVICE : DMA_TO_DEVICE);
+	data->host_cookie = 0;
+}
+
 static void sdhci_set_ios(struct mmc_host *mmc, struct mmc_ios *ios)
 {
 	struct sdhci_host *host;
@@ -1305,6 +1356,8 @@ static unsigned int sdhci_get_host_offset(struct mmc_host *mmc) {
 #endif
 
 static const struct mmc_host_ops sdhci_ops = {
+	.pre_req	= sdhci_pre_req,
+	.post_req	= sdhci_post_req,
 	.request	= sdhci_request,
 	.set_ios	= sdhci_set_ios,
 	.get_ro		= sdhci_get_ro,
@@ -1331,23 +1384,15 @@ static void sdhci_tasklet_card(unsigned long param)
 	sdhci_card_detect_callback(host);
 }
 
-static void sdhci_tasklet_finish(unsigned long param)
+/*
+ * Ends the current request on the host side. Called with the host lock
+ * held; the caller hands the returned request to mmc_request_done()
+ * once the lock is dropped.
+ */
+static struct mmc_request *sdhci_finish_mrq(struct sdhci_host *host)
 {
-	struct sdhci_host *host;
-	unsigned long flags;
 	struct mmc_request *mrq;
 
-	host = (struct sdhci_host*)param;
-
-        /*
-         * If this tasklet gets rescheduled while running, it will
-         * be run again afterwards but without any active request.
-         */
-	if (!host->mrq)
-		return;
-
-	spin_lock_irqsave(&host->lock, flags);
-
 	del_timer(&host->timer);
 
 	mrq = host->mrq;
@@ -1357,10 +1402,8 @@ static void sdhci_tasklet_finish(unsigned long param)
 	 * upon error conditions.
 	 */
 	if (!(host->flags & SDHCI_DEVICE_DEAD) &&
-	    ((mrq->cmd && mrq->cmd->error) ||
-		 (mrq->data && (mrq->data->error ||
-		  (mrq->data->stop && mrq->data->stop->error))) ||
-		   (host->quirks & SDHCI_QUIRK_RESET_AFTER_REQUEST))) {
+	    (sdhci_mrq_failed(mrq) ||
+	     (host->quirks & SDHCI_QUIRK_RESET_AFTER_REQUEST))) {
 
 		/* Some controllers need this kick or reset won't work here */
 		if (host->quirks & SDHCI_QUIRK_CLOCK_BEFORE_RESET) {
@@ -1386,6 +1429,28 @@ static void sdhci_tasklet_finish(unsigned long param)
 	sdhci_deactivate_led(host);
 #endif
 
+	return mrq;
+}
+
+static void sdhci_tasklet_finish(unsigned long param)
+{
+	struct sdhci_host *host;
+	unsigned long flags;
+	struct mmc_request *mrq;
+
+	host = (struct sdhci_host*)param;
+
+        /*
+         * If this tasklet gets rescheduled while running, it will
+         * be run again afterwards but without any active request.
+         */
+	if (!host->mrq)
+		return;
+
+	spin_lock_irqsave(&host->lock, flags);
+
+	mrq = sdhci_finish_mrq(host);
+
 	mmiowb();
 	spin_unlock_irqrestore(&host->lock, flags);
 
@@ -1415,7 +1480,7 @@ static void sdhci_timeout_timer(unsigned long data)
 			else
 				host->mrq->cmd->error = -ETIMEDOUT;
 
-			tasklet_schedule(&host->finish_tasklet);
+			sdhci_request_done(host);
 		}
 	}
 
@@ -1448,7 +1513,7 @@ static void sdhci_cmd_irq(struct sdhci_host *host, u32 intmask)
 		host->cmd->error = -EILSEQ;
 
 	if (host->cmd->error) {
-		tasklet_schedule(&host->finish_tasklet);
+		sdhci_request_done(host);
 		return;
 	}
 
@@ -1578,8 +1643,10 @@ static irqreturn_t sdhci_irq(int irq, void *dev_id)
 	struct sdhci_host* host = dev_id;
 	u32 intmask;
 	int cardint = 0;
+	struct mmc_request *mrq = NULL;
 
 	spin_lock(&host->lock);
+	host->in_irq = 1;
 
 	intmask = sdhci_readl(host, SDHCI_INT_STATUS);
 
@@ -1638,10 +1705,19 @@ static irqreturn_t sdhci_irq(int irq, void *dev_id)
 
 	result = IRQ_HANDLED;
 
-	mmiowb();
 out:
+	host->in_irq = 0;
+	if (host->irq_finish) {
+		host->irq_finish = 0;
+		mrq = sdhci_finish_mrq(host);
+	}
+
+	mmiowb();
 	spin_unlock(&host->lock);
 
+	if (mrq)
+		mmc_request_done(host->mmc, mrq);
+
 	/*
 	 * We have to delay this as it calls back into the driver.
 	 */
@@ -1800,17 +1876,24 @@ int sdhci_add_host(struct sdhci_host *host)
 		/*
 		 * We need to allocate descriptors for all sg entries
 		 * (128) and potentially one alignment transfer for
-		 * each of those entries.
+		 * each of those entries. The table and the align
+		 * buffer share one coherent allocation that is reused
+		 * by every request.
 		 */
-		host->adma_desc = kmalloc((128 * 2 + 1) * 4, GFP_KERNEL);
-		host->align_buffer = kmalloc(128 * 4, GFP_KERNEL);
-		if (!host->adma_desc || !host->align_buffer) {
-			kfree(host->adma_desc);
-			kfree(host->align_buffer);
+		host->adma_desc = dma_alloc_coherent(mmc_dev(mmc),
+			SDHCI_ADMA_TABLE_SZ + SDHCI_ALIGN_BUFFER_SZ,
+			&host->adma_addr, GFP_KERNEL);
+		if (!host->adma_desc) {
 			printk(KERN_WARNING "%s: Unable to allocate ADMA "
 				"buffers. Falling back to standard DMA.\n",
 				mmc_hostname(mmc));
 			host->flags &= ~SDHCI_USE_ADMA;
+		} else {
+			BUG_ON(host->adma_addr & 0x3);
+			host->align_buffer = host->adma_desc +
+				SDHCI_ADMA_TABLE_SZ;
+			host->align_addr = host->adma_addr +
+				SDHCI_ADMA_TABLE_SZ;
 		}
 	}
 
@@ -1909,12 +1992,12 @@ int sdhci_add_host(struct sdhci_host *host)
 	 * can do scatter/gather or not.
 	 */
 	if (host->flags & SDHCI_USE_ADMA)
-		mmc->max_hw_segs = 128;
+		mmc->max_hw_segs = SDHCI_MAX_SEGS;
 	else if (host->flags & SDHCI_USE_SDMA)
 		mmc->max_hw_segs = 1;
 	else /* PIO */
-		mmc->max_hw_segs = 128;
-	mmc->max_phys_segs = 128;
+		mmc->max_hw_segs = SDHCI_MAX_SEGS;
+	mmc->max_phys_segs = SDHCI_MAX_SEGS;
 
 	/*
 	 * Maximum number of sectors in one transfer. Limited by DMA boundary
@@ -2030,7 +2113,7 @@ void sdhci_remove_host(struct sdhci_host *host, int dead)
 				" transfer!\n", mmc_hostname(host->mmc));
 
 			host->mrq->cmd->error = -ENOMEDIUM;
-			tasklet_schedule(&host->finish_tasklet);
+			sdhci_request_done(host);
 		}
 
 		spin_unlock_irqrestore(&host->lock, flags);
@@ -2054,8 +2137,10 @@ void sdhci_remove_host(struct sdhci_host *host, int dead)
 	tasklet_kill(&host->card_tasklet);
 	tasklet_kill(&host->finish_tasklet);
 
-	kfree(host->adma_desc);
-	kfree(host->align_buffer);
+	if (host->adma_desc)
+		dma_free_coherent(mmc_dev(host->mmc),
+			SDHCI_ADMA_TABLE_SZ + SDHCI_ALIGN_BUFFER_SZ,
+			host->adma_desc, host->adma_addr);
 
 	host->adma_desc = NULL;
 	host->align_buffer = NULL;
@@ -2095,7 +2180,7 @@ void sdhci_card_detect_callback(struct sdhci_host *host)
 			sdhci_reset(host, SDHCI_RESET_DATA);
 
 			host->mrq->cmd->error = -ENOMEDIUM;
-			tasklet_schedule(&host->finish_tasklet);
+			sdhci_request_done(host);
 		}
 	}
 
@@ -177,6 +177,15 @@
 #define   SDHCI_SPEC_100	0
 #define   SDHCI_SPEC_200	1
 
+/*
+ * The ADMA table has room for a data descriptor and an alignment
+ * descriptor per segment, plus the terminating entry.
+ */
+#define SDHCI_MAX_SEGS		128
+#define SDHCI_ADMA_DESC_SZ	8
+#define SDHCI_ADMA_TABLE_SZ	((SDHCI_MAX_SEGS * 2 + 1) * SDHCI_ADMA_DESC_SZ)
+#define SDHCI_ALIGN_BUFFER_SZ	(SDHCI_MAX_SEGS * 4)
+
 struct sdhci_ops;
 
 struct sdhci_host {
@@ -285,6 +294,9 @@ struct sdhci_host {
 	struct mmc_command	*cmd;		/* Current command */
 	struct mmc_data		*data;		/* Current data request */
 	unsigned int		data_early:1;	/* Data finished before cmd */
+	unsigned int		align_used:1;	/* ADMA used the align buffer */
+	unsigned int		in_irq:1;	/* Inside sdhci_irq() */
+	unsigned int		irq_finish:1;	/* sdhci_irq() finishes mrq */
 
 	struct sg_mapping_iter	sg_miter;	/* SG state for PIO */
 	unsigned int		blocks;		/* remaining PIO blocks */
@@ -294,8 +306,8 @@ struct sdhci_host {
 	u8			*adma_desc;	/* ADMA descriptor table */
 	u8			*align_buffer;	/* Bounce buffer */
 
-	dma_addr_t		adma_addr;	/* Mapped ADMA descr. table */
-	dma_addr_t		align_addr;	/* Mapped bounce buffer */
+	dma_addr_t		adma_addr;	/* Bus addr. of ADMA table */
+	dma_addr_t		align_addr;	/* Bus addr. of bounce buffer */
 
 	struct tasklet_struct	card_tasklet;	/* Tasklet structures */
 	struct tasklet_struct	finish_tasklet;
@@ -43,6 +43,7 @@ static HLIST_HEAD(binder_dead_nodes);
 
 static struct proc_dir_entry *binder_proc_dir_entry_root;
 static struct proc_dir_entry *binder_proc_dir_entry_proc;
+static struct proc_dir_entry *binder_proc_dir_entry_latency;
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
 static int binder_last_id;
@@ -50,6 +51,8 @@ static struct workqueue_struct *binder_deferred_workqueue;
 
 static int binder_read_proc_proc(char *page, char **start, off_t off,
 				 int count, int *eof, void *data);
+static int binder_read_proc_latency(char *page, char **start, off_t off,
+				    int count, int *eof, void *data);
 
 /* This is only defined in include/asm-arm/sizes.h */
 #ifndef SZ_1K
@@ -89,6 +92,9 @@ module_param_named(debug_mask, binder_debug_mask, uint, S_IWUSR | S_IRUGO);
 static int binder_debug_no_lock;
 module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
 
+static int binder_max_warm_pages = 8;
+module_param_named(max_warm_pages, binder_max_warm_pages, int, S_IWUSR | S_IRUGO);
+
 static DECLARE_WAIT_QUEUE_HEAD(binder_user_error_wait);
 static int binder_stop_on_user_error;
 
@@ -206,6 +212,7 @@ struct binder_node {
 	int internal_strong_refs;
 	int local_weak_refs;
 	int local_strong_refs;
+	int tmp_ref; /* senders holding a strong ref with binder_lock dropped */
 	void __user *ptr;
 	void __user *cookie;
 	unsigned has_strong_ref:1;
@@ -214,6 +221,7 @@ struct binder_node {
 	unsigned pending_weak_ref:1;
 	unsigned has_async_transaction:1;
 	unsigned accept_fds:1;
+	unsigned inherit_rt:1;
 	unsigned min_priority:8;
 	struct list_head async_todo;
 };
@@ -257,6 +265,8 @@ struct binder_buffer {
 	uint8_t data[0];
 };
 
+#define BINDER_LATENCY_BUCKETS 20
+
 enum binder_deferred_state {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
@@ -286,8 +296,15 @@ struct binder_proc {
 	struct page **pages;
 	size_t buffer_size;
 	uint32_t buffer_free;
+	int warm_pages; /* freed pages left mapped for reuse */
+	int pages_allocated;
+	int warm_pages_reused;
+	/* log2(us) histograms, written under binder_lock, read without it */
+	u32 wakeup_latency[BINDER_LATENCY_BUCKETS];
+	u32 reply_latency[BINDER_LATENCY_BUCKETS];
 	struct list_head todo;
 	wait_queue_head_t wait;
+	struct list_head waiting_threads; /* idle loopers, most recent first */
 	struct binder_stats stats;
 	struct list_head delivered_death;
 	int max_threads;
@@ -295,6 +312,10 @@ struct binder_proc {
 	int requested_threads_started;
 	int ready_threads;
 	long default_priority;
+	int wakeups;
+	int wakeups_no_work;
+	int tmp_ref; /* pins proc while binder_lock is dropped */
+	unsigned is_dead:1;
 };
 
 enum {
@@ -303,7 +324,8 @@ enum {
 	BINDER_LOOPER_STATE_EXITED      = 0x04,
 	BINDER_LOOPER_STATE_INVALID     = 0x08,
 	BINDER_LOOPER_STATE_WAITING     = 0x10,
-	BINDER_LOOPER_STATE_NEED_RETURN = 0x20
+	BINDER_LOOPER_STATE_NEED_RETURN = 0x20,
+	BINDER_LOOPER_STATE_WOKEN       = 0x40
 };
 
 struct binder_thread {
@@ -313,6 +335,7 @@ struct binder_thread {
 	int looper;
 	struct binder_transaction *transaction_stack;
 	struct list_head todo;
+	struct list_head waiting_thread_node;
 	uint32_t return_error; /* Write failed, return error code in read buf */
 	uint32_t return_error2; /* Write failed, return error code in read */
 		/* buffer. Used when sending a reply to a dead process that */
@@ -337,11 +360,35 @@ struct binder_transaction {
 	unsigned int	flags;
 	long	priority;
 	long	saved_priority;
+	unsigned int	sched_policy;
+	unsigned int	rt_priority;
+	unsigned int	saved_sched_policy;
+	unsigned int	saved_rt_priority;
 	uid_t	sender_euid;
+	ktime_t	timestamp; /* queued, or delivered when awaiting a reply */
 };
 
+#define CREATE_TRACE_POINTS
+#include "binder_trace.h"
+
+static s64 binder_latency_record(u32 *hist, ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+	int bucket;
+
+	if (us <= 0)
+		bucket = 0;
+	else if (us >= 1LL << (BINDER_LATENCY_BUCKETS - 2))
+		bucket = BINDER_LATENCY_BUCKETS - 1;
+	else
+		bucket = fls((u32)us);
+	hist[bucket]++;
+	return us;
+}
+
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
+static void binder_proc_dec_tmpref(struct binder_proc *proc);
 
 /*
  * copied from get_unused_fd_flags
@@ -498,6 +545,46 @@ static void binder_set_nice(long nice)
 	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
 }
 
+static int binder_is_rt_policy(unsigned int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static void binder_set_sched(unsigned int policy, unsigned int rt_priority)
+{
+	struct sched_param param;
+
+	if (current->policy == policy && current->rt_priority == rt_priority)
+		return;
+	param.sched_priority = binder_is_rt_policy(policy) ? rt_priority : 0;
+	if (sched_setscheduler_nocheck(current, policy, &param))
+		binder_debug(BINDER_DEBUG_PRIORITY_CAP,
+			     "binder: %d: failed to set policy %u prio %u\n",
+			     current->pid, policy, rt_priority);
+}
+
+/*
+ * Hand proc work to the most recently idle looper that has not already
+ * been woken, instead of the wait queue, so only one thread wakes and it
+ * is the one most likely to still be cache hot. poll() users wait on
+ * proc->wait.
+ */
+static void binder_wakeup_proc(struct binder_proc *proc)
+{
+	struct binder_thread *thread;
+
+	list_for_each_entry(thread, &proc->waiting_threads,
+			    waiting_thread_node) {
+		if (thread->looper & BINDER_LOOPER_STATE_WOKEN)
+			continue;
+		thread->looper |= BINDER_LOOPER_STATE_WOKEN;
+		proc->wakeups++;
+		wake_up_interruptible(&thread->wait);
+		return;
+	}
+	wake_up_interruptible(&proc->wait);
+}
+
 static size_t binder_buffer_size(struct binder_proc *proc,
 				 struct binder_buffer *buffer)
 {
@@ -631,7 +718,13 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		struct page **page_array_ptr;
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
+		if (*page) {
+			/* still mapped from an earlier free */
+			BUG_ON(proc->warm_pages <= 0);
+			proc->warm_pages--;
+			proc->warm_pages_reused++;
+			continue;
+		}
 		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
 		if (*page == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
@@ -658,6 +751,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 			goto err_vm_insert_page_failed;
 		}
 		/* vm_insert_page does not seem to increment the refcount */
+		proc->pages_allocated++;
 	}
 	if (mm) {
 		up_write(&mm->mmap_sem);
@@ -669,6 +763,15 @@ free_range:
 	for (page_addr = end - PAGE_SIZE; page_addr >= start;
 	     page_addr -= PAGE_SIZE) {
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (vma && proc->warm_pages < binder_max_warm_pages) {
+			/*
+			 * Keep the page mapped in both address spaces so the
+			 * next allocation touching it does not have to
+			 * allocate, map and fault it in again.
+			 */
+			proc->warm_pages++;
+			continue;
+		}
 		if (vma)
 			zap_page_range(vma, (uintptr_t)page_addr +
 				proc->user_buffer_offset, PAGE_SIZE, NULL);
@@ -1018,7 +1121,7 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 	if (node->proc && (node->has_strong_ref || node->has_weak_ref)) {
 		if (list_empty(&node->work.entry)) {
 			list_add_tail(&node->work.entry, &node->proc->todo);
-			wake_up_interruptible(&node->proc->wait);
+			binder_wakeup_proc(node->proc);
 		}
 	} else {
 		if (hlist_empty(&node->refs) && !node->local_strong_refs &&
@@ -1371,10 +1474,15 @@ static void binder_transaction(struct binder_proc *proc,
 	struct list_head *target_list;
 	wait_queue_head_t *target_wait;
 	struct binder_transaction *in_reply_to = NULL;
-	struct binder_transaction_log_entry *e;
+	struct binder_transaction_log_entry log_entry, *e = &log_entry;
 	uint32_t return_error;
+	int copy_failed;
 
-	e = binder_transaction_log_add(&binder_transaction_log);
+	/*
+	 * binder_lock is dropped while copying the data, so the entry is
+	 * built on the stack and only stored in the logs at the end.
+	 */
+	memset(e, 0, sizeof(*e));
 	e->call_type = reply ? 2 : !!(tr->flags & TF_ONE_WAY);
 	e->from_proc = proc->pid;
 	e->from_thread = thread->pid;
@@ -1392,6 +1500,8 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_empty_call_stack;
 		}
 		binder_set_nice(in_reply_to->saved_priority);
+		binder_set_sched(in_reply_to->saved_sched_policy,
+				 in_reply_to->saved_rt_priority);
 		if (in_reply_to->to_thread != thread) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
@@ -1405,6 +1515,9 @@ static void binder_transaction(struct binder_proc *proc,
 			in_reply_to = NULL;
 			goto err_bad_call_stack;
 		}
+		trace_binder_transaction_reply(in_reply_to,
+			binder_latency_record(proc->reply_latency,
+					      in_reply_to->timestamp));
 		thread->transaction_stack = in_reply_to->to_parent;
 		target_thread = in_reply_to->from;
 		if (target_thread == NULL) {
@@ -1471,14 +1584,8 @@ static void binder_transaction(struct binder_proc *proc,
 			}
 		}
 	}
-	if (target_thread) {
+	if (target_thread)
 		e->to_thread = target_thread->pid;
-		target_list = &target_thread->todo;
-		target_wait = &target_thread->wait;
-	} else {
-		target_list = &target_proc->todo;
-		target_wait = &target_proc->wait;
-	}
 	e->to_proc = target_proc->pid;
 
 	/* TODO: reuse incoming transaction for reply */
@@ -1526,6 +1633,8 @@ static void binder_transaction(struct binder_proc *proc,
 	t->code = tr->code;
 	t->flags = tr->flags;
 	t->priority = task_nice(current);
+	t->sched_policy = current->policy;
+	t->rt_priority = current->rt_priority;
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
 		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
 	if (t->buffer == NULL) {
@@ -1536,20 +1645,82 @@ static void binder_transaction(struct binder_proc *proc,
 	t->buffer->debug_id = t->debug_id;
 	t->buffer->transaction = t;
 	t->buffer->target_node = target_node;
+	trace_binder_transaction_alloc_buf(t->buffer);
 	if (target_node)
 		binder_inc_node(target_node, 1, 0, NULL);
 
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
 
-	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
-		binder_user_error("binder: %d:%d got transaction with invalid "
-			"data ptr\n", proc->pid, thread->pid);
-		return_error = BR_FAILED_REPLY;
-		goto err_copy_data_failed;
+	/*
+	 * The buffer is not visible to the target yet, so the copy from the
+	 * sender can fault and sleep without holding binder_lock. The
+	 * temporary references keep target_proc, its buffer area and the
+	 * strong ref on target_node around if the target dies meanwhile.
+	 */
+	target_proc->tmp_ref++;
+	if (target_node)
+		target_node->tmp_ref++;
+	mutex_unlock(&binder_lock);
+	copy_failed = 0;
+	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer,
+			   tr->data_size))
+		copy_failed = 1;
+	else if (copy_from_user(offp, tr->data.ptr.offsets,
+				tr->offsets_size))
+		copy_failed = 2;
+	mutex_lock(&binder_lock);
+	if (target_node)
+		target_node->tmp_ref--;
+
+	if (target_proc->is_dead) {
+		binder_transaction_buffer_release(target_proc, t->buffer,
+						  offp);
+		t->buffer->transaction = NULL;
+		binder_free_buf(target_proc, t->buffer);
+		binder_proc_dec_tmpref(target_proc);
+		return_error = BR_DEAD_REPLY;
+		goto err_binder_alloc_buf_failed;
 	}
-	if (copy_from_user(offp, tr->data.ptr.offsets, tr->offsets_size)) {
+	binder_proc_dec_tmpref(target_proc);
+
+	/* target threads may have exited while binder_lock was dropped */
+	if (reply) {
+		target_thread = in_reply_to->from;
+		if (target_thread == NULL) {
+			return_error = BR_DEAD_REPLY;
+			goto err_copy_data_failed;
+		}
+		if (target_thread->transaction_stack != in_reply_to) {
+			binder_user_error("binder: %d:%d reply target %d:%d "
+				"changed transaction stack\n",
+				proc->pid, thread->pid, target_proc->pid,
+				target_thread->pid);
+			return_error = BR_FAILED_REPLY;
+			in_reply_to = NULL;
+			target_thread = NULL;
+			goto err_copy_data_failed;
+		}
+	} else if (target_thread) {
+		struct binder_transaction *tmp;
+
+		target_thread = NULL;
+		for (tmp = thread->transaction_stack; tmp; tmp = tmp->from_parent)
+			if (tmp->from && tmp->from->proc == target_proc)
+				target_thread = tmp->from;
+		t->to_thread = target_thread;
+	}
+	if (target_thread) {
+		target_list = &target_thread->todo;
+		target_wait = &target_thread->wait;
+	} else {
+		target_list = &target_proc->todo;
+		target_wait = &target_proc->wait;
+	}
+
+	if (copy_failed) {
 		binder_user_error("binder: %d:%d got transaction with invalid "
-			"offsets ptr\n", proc->pid, thread->pid);
+			"%s ptr\n", proc->pid, thread->pid,
+			copy_failed == 1 ? "data" : "offsets");
 		return_error = BR_FAILED_REPLY;
 		goto err_copy_data_failed;
 	}
@@ -1586,6 +1757,7 @@ static void binder_transaction(struct binder_proc *proc,
 				}
 				node->min_priority = fp->flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
 				node->accept_fds = !!(fp->flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
+				node->inherit_rt = !!(fp->flags & FLAT_BINDER_FLAG_INHERIT_RT);
 			}
 			if (fp->cookie != node->cookie) {
 				binder_user_error("binder: %d:%d sending u%p "
@@ -1717,11 +1889,18 @@ static void binder_transaction(struct binder_proc *proc,
 			target_node->has_async_transaction = 1;
 	}
 	t->work.type = BINDER_WORK_TRANSACTION;
+	t->timestamp = ktime_get();
+	trace_binder_transaction(reply, t, target_node);
 	list_add_tail(&t->work.entry, target_list);
 	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
 	list_add_tail(&tcomplete->entry, &thread->todo);
-	if (target_wait)
-		wake_up_interruptible(target_wait);
+	if (target_wait) {
+		if (target_thread)
+			wake_up_interruptible(target_wait);
+		else
+			binder_wakeup_proc(target_proc);
+	}
+	*binder_transaction_log_add(&binder_transaction_log) = *e;
 	return;
 
 err_get_unused_fd_failed:
@@ -1753,11 +1932,8 @@ err_no_context_mgr_node:
 		     proc->pid, thread->pid, return_error,
 		     tr->data_size, tr->offsets_size);
 
-	{
-		struct binder_transaction_log_entry *fe;
-		fe = binder_transaction_log_add(&binder_transaction_log_failed);
-		*fe = *e;
-	}
+	*binder_transaction_log_add(&binder_transaction_log) = *e;
+	*binder_transaction_log_add(&binder_transaction_log_failed) = *e;
 
 	BUG_ON(thread->return_error != BR_OK);
 	if (in_reply_to) {
@@ -1947,6 +2123,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				else
 					list_move_tail(buffer->target_node->async_todo.next, &thread->todo);
 			}
+			trace_binder_transaction_free_buf(buffer);
 			binder_transaction_buffer_release(proc, buffer, NULL);
 			binder_free_buf(proc, buffer);
 			break;
@@ -2067,7 +2244,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						list_add_tail(&ref->death->work.entry, &thread->todo);
 					} else {
 						list_add_tail(&ref->death->work.entry, &proc->todo);
-						wake_up_interruptible(&proc->wait);
+						binder_wakeup_proc(proc);
 					}
 				}
 			} else {
@@ -2097,7 +2274,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						list_add_tail(&death->work.entry, &thread->todo);
 					} else {
 						list_add_tail(&death->work.entry, &proc->todo);
-						wake_up_interruptible(&proc->wait);
+						binder_wakeup_proc(proc);
 					}
 				} else {
 					BUG_ON(death->work.type != BINDER_WORK_DEAD_BINDER);
@@ -2137,7 +2314,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					list_add_tail(&death->work.entry, &thread->todo);
 				} else {
 					list_add_tail(&death->work.entry, &proc->todo);
-					wake_up_interruptible(&proc->wait);
+					binder_wakeup_proc(proc);
 				}
 			}
 		} break;
@@ -2169,6 +2346,40 @@ static int binder_has_proc_work(struct binder_proc *proc,
 		(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN);
 }
 
+/*
+ * Sleep until there is proc work, called with binder_lock not held.
+ * The thread stays on proc->waiting_threads for the whole wait; a waker
+ * only marks it WOKEN. The mark is cleared under binder_lock together
+ * with the work check, so a looper whose work was taken by another
+ * thread can be picked again before it goes back to sleep.
+ */
+static int binder_wait_for_proc_work(struct binder_proc *proc,
+				     struct binder_thread *thread)
+{
+	DEFINE_WAIT(wait);
+	int has_work;
+	int ret = 0;
+
+	for (;;) {
+		mutex_lock(&binder_lock);
+		thread->looper &= ~BINDER_LOOPER_STATE_WOKEN;
+		has_work = binder_has_proc_work(proc, thread);
+		if (!has_work)
+			prepare_to_wait(&thread->wait, &wait,
+					TASK_INTERRUPTIBLE);
+		mutex_unlock(&binder_lock);
+		if (has_work)
+			break;
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		schedule();
+	}
+	finish_wait(&thread->wait, &wait);
+	return ret;
+}
+
 static int binder_has_thread_work(struct binder_thread *thread)
 {
 	return !list_empty(&thread->todo) || thread->return_error != BR_OK ||
@@ -2214,8 +2425,15 @@ retry:
 
 
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
-	if (wait_for_proc_work)
+	if (wait_for_proc_work) {
 		proc->ready_threads++;
+		if (!non_block)
+			list_add(&thread->waiting_thread_node,
+				 &proc->waiting_threads);
+	}
+	trace_binder_wait_for_work(wait_for_proc_work,
+				   !!thread->transaction_stack,
+				   !list_empty(&thread->todo));
 	mutex_unlock(&binder_lock);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
@@ -2232,7 +2450,7 @@ retry:
 			if (!binder_has_proc_work(proc, thread))
 				ret = -EAGAIN;
 		} else
-			ret = wait_event_interruptible_exclusive(proc->wait, binder_has_proc_work(proc, thread));
+			ret = binder_wait_for_proc_work(proc, thread);
 	} else {
 		if (non_block) {
 			if (!binder_has_thread_work(thread))
@@ -2241,12 +2459,20 @@ retry:
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
 	mutex_lock(&binder_lock);
-	if (wait_for_proc_work)
+	trace_binder_wakeup(wait_for_proc_work, ret);
+	if (wait_for_proc_work) {
 		proc->ready_threads--;
-	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
+		list_del_init(&thread->waiting_thread_node);
+	}
+	thread->looper &= ~(BINDER_LOOPER_STATE_WAITING |
+			    BINDER_LOOPER_STATE_WOKEN);
 
-	if (ret)
+	if (ret) {
+		/* a wakeup handed to us may be lost; pass it on */
+		if (wait_for_proc_work && !list_empty(&proc->todo))
+			binder_wakeup_proc(proc);
 		return ret;
+	}
 
 	while (1) {
 		uint32_t cmd;
@@ -2259,8 +2485,10 @@ retry:
 		else if (!list_empty(&proc->todo) && wait_for_proc_work)
 			w = list_first_entry(&proc->todo, struct binder_work, entry);
 		else {
-			if (ptr - buffer == 4 && !(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN)) /* no data added */
+			if (ptr - buffer == 4 && !(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN)) { /* no data added */
+				proc->wakeups_no_work++;
 				goto retry;
+			}
 			break;
 		}
 
@@ -2391,12 +2619,19 @@ retry:
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
 			t->saved_priority = task_nice(current);
+			t->saved_sched_policy = current->policy;
+			t->saved_rt_priority = current->rt_priority;
 			if (t->priority < target_node->min_priority &&
 			    !(t->flags & TF_ONE_WAY))
 				binder_set_nice(t->priority);
 			else if (!(t->flags & TF_ONE_WAY) ||
 				 t->saved_priority > target_node->min_priority)
 				binder_set_nice(target_node->min_priority);
+			if (target_node->inherit_rt && !(t->flags & TF_ONE_WAY) &&
+			    binder_is_rt_policy(t->sched_policy) &&
+			    (!binder_is_rt_policy(current->policy) ||
+			     current->rt_priority < t->rt_priority))
+				binder_set_sched(t->sched_policy, t->rt_priority);
 			cmd = BR_TRANSACTION;
 		} else {
 			tr.target.ptr = NULL;
@@ -2431,6 +2666,9 @@ retry:
 		ptr += sizeof(tr);
 
 		binder_stat_br(proc, thread, cmd);
+		trace_binder_transaction_received(t,
+			binder_latency_record(proc->wakeup_latency,
+					      t->timestamp));
 		binder_debug(BINDER_DEBUG_TRANSACTION,
 			     "binder: %d:%d %s %d %d:%d, cmd %d"
 			     "size %zd-%zd ptr %p-%p\n",
@@ -2447,6 +2685,7 @@ retry:
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
 			t->to_parent = thread->transaction_stack;
 			t->to_thread = thread;
+			t->timestamp = ktime_get();
 			thread->transaction_stack = t;
 		} else {
 			t->buffer->transaction = NULL;
@@ -2525,6 +2764,7 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		thread->pid = current->pid;
 		init_waitqueue_head(&thread->wait);
 		INIT_LIST_HEAD(&thread->todo);
+		INIT_LIST_HEAD(&thread->waiting_thread_node);
 		rb_link_node(&thread->rb_node, parent, p);
 		rb_insert_color(&thread->rb_node, &proc->threads);
 		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
@@ -2542,6 +2782,7 @@ static int binder_free_thread(struct binder_proc *proc,
 	int active_transactions = 0;
 
 	rb_erase(&thread->rb_node, &proc->threads);
+	list_del_init(&thread->waiting_thread_node);
 	t = thread->transaction_stack;
 	if (t && t->to_thread == thread)
 		send_reply = t;
@@ -2654,7 +2895,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		if (bwr.read_size > 0) {
 			ret = binder_thread_read(proc, thread, (void __user *)bwr.read_buffer, bwr.read_size, &bwr.read_consumed, filp->f_flags & O_NONBLOCK);
 			if (!list_empty(&proc->todo))
-				wake_up_interruptible(&proc->wait);
+				binder_wakeup_proc(proc);
 			if (ret < 0) {
 				if (copy_to_user(ubuf, &bwr, sizeof(bwr)))
 					ret = -EFAULT;
@@ -2868,6 +3109,7 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
+	INIT_LIST_HEAD(&proc->waiting_threads);
 	proc->default_priority = task_nice(current);
 	mutex_lock(&binder_lock);
 	binder_stats_created(BINDER_STAT_PROC);
@@ -2885,6 +3127,14 @@ static int binder_open(struct inode *nodp, struct file *filp)
 				       binder_proc_dir_entry_proc,
 				       binder_read_proc_proc, proc);
 	}
+	if (binder_proc_dir_entry_latency) {
+		char strbuf[11];
+		snprintf(strbuf, sizeof(strbuf), "%u", proc->pid);
+		remove_proc_entry(strbuf, binder_proc_dir_entry_latency);
+		create_proc_read_entry(strbuf, S_IRUGO,
+				       binder_proc_dir_entry_latency,
+				       binder_read_proc_latency, proc);
+	}
 
 	return 0;
 }
@@ -2925,22 +3175,91 @@ static int binder_release(struct inode *nodp, struct file *filp)
 		snprintf(strbuf, sizeof(strbuf), "%u", proc->pid);
 		remove_proc_entry(strbuf, binder_proc_dir_entry_proc);
 	}
+	if (binder_proc_dir_entry_latency) {
+		char strbuf[11];
+		snprintf(strbuf, sizeof(strbuf), "%u", proc->pid);
+		remove_proc_entry(strbuf, binder_proc_dir_entry_latency);
+	}
 
 	binder_defer_work(proc, BINDER_DEFERRED_RELEASE);
 
 	return 0;
 }
 
+static void binder_free_proc(struct binder_proc *proc)
+{
+	struct binder_transaction *t;
+	struct rb_node *n;
+	int buffers, page_count;
+
+	BUG_ON(proc->tmp_ref);
+
+	buffers = 0;
+	while ((n = rb_first(&proc->allocated_buffers))) {
+		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
+							rb_node);
+		t = buffer->transaction;
+		if (t) {
+			t->buffer = NULL;
+			buffer->transaction = NULL;
+			printk(KERN_ERR "binder: release proc %d, "
+			       "transaction %d, not freed\n",
+			       proc->pid, t->debug_id);
+			/*BUG();*/
+		}
+		binder_free_buf(proc, buffer);
+		buffers++;
+	}
+
+	binder_stats_deleted(BINDER_STAT_PROC);
+
+	page_count = 0;
+	if (proc->pages) {
+		int i;
+		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+			if (proc->pages[i]) {
+				void *page_addr = proc->buffer + i * PAGE_SIZE;
+				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+					     "binder_release: %d: "
+					     "page %d at %p not freed\n",
+					     proc->pid, i,
+					     page_addr);
+				unmap_kernel_range((unsigned long)page_addr,
+					PAGE_SIZE);
+				__free_page(proc->pages[i]);
+				page_count++;
+			}
+		}
+		kfree(proc->pages);
+		vfree(proc->buffer);
+	}
+
+	put_task_struct(proc->tsk);
+
+	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
+		     "binder_release: %d buffers %d, pages %d\n",
+		     proc->pid, buffers, page_count);
+
+	kfree(proc);
+}
+
+static void binder_proc_dec_tmpref(struct binder_proc *proc)
+{
+	proc->tmp_ref--;
+	if (proc->is_dead && !proc->tmp_ref)
+		binder_free_proc(proc);
+}
+
 static void binder_deferred_release(struct binder_proc *proc)
 {
 	struct hlist_node *pos;
-	struct binder_transaction *t;
 	struct rb_node *n;
-	int threads, nodes, incoming_refs, outgoing_refs, buffers, active_transactions, page_count;
+	int threads, nodes, incoming_refs, outgoing_refs, active_transactions;
 
 	BUG_ON(proc->vma);
 	BUG_ON(proc->files);
 
+	proc->is_dead = 1;
 	hlist_del(&proc->proc_node);
 	if (binder_context_mgr_node && binder_context_mgr_node->proc == proc) {
 		binder_debug(BINDER_DEBUG_DEAD_BINDER,
@@ -2964,15 +3283,19 @@ static void binder_deferred_release(struct binder_proc *proc)
 		nodes++;
 		rb_erase(&node->rb_node, &proc->nodes);
 		list_del_init(&node->work.entry);
-		if (hlist_empty(&node->refs)) {
+		if (hlist_empty(&node->refs) && !node->tmp_ref) {
 			kfree(node);
 			binder_stats_deleted(BINDER_STAT_NODE);
 		} else {
 			struct binder_ref *ref;
 			int death = 0;
 
+			/*
+			 * Senders copying into our buffers still hold one
+			 * strong ref each and drop it when they see is_dead.
+			 */
 			node->proc = NULL;
-			node->local_strong_refs = 0;
+			node->local_strong_refs = node->tmp_ref;
 			node->local_weak_refs = 0;
 			hlist_add_head(&node->dead_node, &binder_dead_nodes);
 
@@ -2983,7 +3306,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 					if (list_empty(&ref->death->work.entry)) {
 						ref->death->work.type = BINDER_WORK_DEAD_BINDER;
 						list_add_tail(&ref->death->work.entry, &ref->proc->todo);
-						wake_up_interruptible(&ref->proc->wait);
+						binder_wakeup_proc(ref->proc);
 					} else
 						BUG();
 				}
@@ -3002,57 +3325,17 @@ static void binder_deferred_release(struct binder_proc *proc)
 		binder_delete_ref(ref);
 	}
 	binder_release_work(&proc->todo);
-	buffers = 0;
-
-	while ((n = rb_first(&proc->allocated_buffers))) {
-		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
-							rb_node);
-		t = buffer->transaction;
-		if (t) {
-			t->buffer = NULL;
-			buffer->transaction = NULL;
-			printk(KERN_ERR "binder: release proc %d, "
-			       "transaction %d, not freed\n",
-			       proc->pid, t->debug_id);
-			/*BUG();*/
-		}
-		binder_free_buf(proc, buffer);
-		buffers++;
-	}
-
-	binder_stats_deleted(BINDER_STAT_PROC);
-
-	page_count = 0;
-	if (proc->pages) {
-		int i;
-		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
-				void *page_addr = proc->buffer + i * PAGE_SIZE;
-				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-					     "binder_release: %d: "
-					     "page %d at %p not freed\n",
-					     proc->pid, i,
-					     page_addr);
-				unmap_kernel_range((unsigned long)page_addr,
-					PAGE_SIZE);
-				__free_page(proc->pages[i]);
-				page_count++;
-			}
-		}
-		kfree(proc->pages);
-		vfree(proc->buffer);
-	}
-
-	put_task_struct(proc->tsk);
 
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
 		     "binder_release: %d threads %d, nodes %d (ref %d), "
-		     "refs %d, active transactions %d, buffers %d, "
-		     "pages %d\n",
+		     "refs %d, active transactions %d%s\n",
 		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
-		     active_transactions, buffers, page_count);
+		     active_transactions,
+		     proc->tmp_ref ? ", buffers in use" : "");
 
-	kfree(proc);
+	/* an in-flight sender frees the buffer area once it is done */
+	if (!proc->tmp_ref)
+		binder_free_proc(proc);
 }
 
 static void binder_deferred_func(struct work_struct *work)
@@ -3439,6 +3722,7 @@ static char *print_binder_proc_stats(char *buf, char *end,
 	struct binder_work *w;
 	struct rb_node *n;
 	int count, strong, weak;
+	size_t free_space, largest_free;
 
 	buf += snprintf(buf, end - buf, "proc %d\n", proc->pid);
 	if (buf >= end)
@@ -3451,9 +3735,11 @@ static char *print_binder_proc_stats(char *buf, char *end,
 		return buf;
 	buf += snprintf(buf, end - buf, "  requested threads: %d+%d/%d\n"
 			"  ready threads %d\n"
+			"  wakeups %d (no work %d)\n"
 			"  free async space %zd\n", proc->requested_threads,
 			proc->requested_threads_started, proc->max_threads,
-			proc->ready_threads, proc->free_async_space);
+			proc->ready_threads, proc->wakeups,
+			proc->wakeups_no_work, proc->free_async_space);
 	if (buf >= end)
 		return buf;
 	count = 0;
@@ -3484,6 +3770,27 @@ static char *print_binder_proc_stats(char *buf, char *end,
 	if (buf >= end)
 		return buf;
 
+	count = 0;
+	free_space = 0;
+	largest_free = 0;
+	for (n = rb_first(&proc->free_buffers); n != NULL; n = rb_next(n)) {
+		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
+							rb_node);
+		size_t size = binder_buffer_size(proc, buffer);
+		count++;
+		free_space += size;
+		if (size > largest_free)
+			largest_free = size;
+	}
+	buf += snprintf(buf, end - buf, "  free buffers: %d size %zd "
+			"largest %zd\n"
+			"  pages: allocated %d warm %d reused %d\n",
+			count, free_space, largest_free,
+			proc->pages_allocated, proc->warm_pages,
+			proc->warm_pages_reused);
+	if (buf >= end)
+		return buf;
+
 	count = 0;
 	list_for_each_entry(w, &proc->todo, entry) {
 		switch (w->type) {
@@ -3661,6 +3968,59 @@ static int binder_read_proc_proc(char *page, char **start, off_t off,
 	return len < count ? len  : count;
 }
 
+static char *print_binder_latency(char *buf, char *end, const char *name,
+				  u32 *hist)
+{
+	int i;
+
+	buf += snprintf(buf, end - buf, "%s:\n", name);
+	for (i = 0; i < BINDER_LATENCY_BUCKETS; i++) {
+		if (buf >= end)
+			break;
+		if (!hist[i])
+			continue;
+		buf += snprintf(buf, end - buf, "  %8lu%s us: %u\n",
+				i ? 1UL << (i - 1) : 0,
+				i == BINDER_LATENCY_BUCKETS - 1 ? "+" : " ",
+				hist[i]);
+	}
+	return buf;
+}
+
+/*
+ * The histograms are only ever added to, so they are printed without
+ * binder_lock; the proc entry is removed before proc can go away.
+ */
+static int binder_read_proc_latency(char *page, char **start, off_t off,
+				    int count, int *eof, void *data)
+{
+	struct binder_proc *proc = data;
+	int len = 0;
+	char *buf = page;
+	char *end = page + PAGE_SIZE;
+
+	if (off)
+		return 0;
+
+	buf += snprintf(buf, end - buf, "proc %d\n", proc->pid);
+	buf = print_binder_latency(buf, end, "send to wakeup",
+				   proc->wakeup_latency);
+	buf = print_binder_latency(buf, end, "wakeup to reply",
+				   proc->reply_latency);
+
+	if (buf > page + PAGE_SIZE)
+		buf = page + PAGE_SIZE;
+	*start = page + off;
+
+	len = buf - page;
+	if (len > off)
+		len -= off;
+	else
+		len = 0;
+
+	return len < count ? len  : count;
+}
+
 static char *print_binder_transaction_log_entry(char *buf, char *end,
 					struct binder_transaction_log_entry *e)
 {
@@ -3737,9 +4097,12 @@ static int __init binder_init(void)
 		return -ENOMEM;
 
 	binder_proc_dir_entry_root = proc_mkdir("binder", NULL);
-	if (binder_proc_dir_entry_root)
+	if (binder_proc_dir_entry_root) {
 		binder_proc_dir_entry_proc = proc_mkdir("proc",
 						binder_proc_dir_entry_root);
+		binder_proc_dir_entry_latency = proc_mkdir("latency",
+						binder_proc_dir_entry_root);
+	}
 	ret = misc_register(&binder_miscdev);
 	if (binder_proc_dir_entry_root) {
 		create_proc_read_entry("state",
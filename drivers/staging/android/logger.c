@@ -56,8 +56,14 @@ struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	int			batch;	/* read() returns all entries that fit */
+	char			*batch_buf; /* staging for batch reads */
+	struct mutex		batch_lock; /* serializes use of batch_buf */
 };
 
+/* largest batch a single read() stages, see logger_read() */
+#define LOGGER_BATCH_LEN	(8 * LOGGER_ENTRY_MAX_LEN)
+
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
@@ -106,6 +112,23 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 	return sizeof(struct logger_entry) + val;
 }
 
+/*
+ * clock_interval - is a < c < b in mod-space? Put another way, does the line
+ * from a to b cross c?
+ */
+static inline int clock_interval(size_t a, size_t b, size_t c)
+{
+	if (b < a) {
+		if (a < c || b >= c)
+			return 1;
+	} else {
+		if (a < c && b >= c)
+			return 1;
+	}
+
+	return 0;
+}
+
 /*
  * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
  * user-space buffer 'buf'. Returns 'count' on success.
@@ -141,6 +164,81 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	return count;
 }
 
+/*
+ * do_read_batch - copies as many whole entries as fit in 'count' bytes from
+ * 'log', starting at offset 'off', into the kernel buffer 'buf'. Returns the
+ * number of bytes copied. The read head is not moved.
+ *
+ * Caller must hold log->mutex.
+ */
+static size_t do_read_batch(struct logger_log *log, size_t off,
+			    char *buf, size_t count)
+{
+	size_t ret = 0;
+
+	while (log->w_off != off) {
+		size_t len = get_entry_len(log, off);
+		size_t first;
+
+		if (count - ret < len)
+			break;
+		first = min(len, log->size - off);
+		memcpy(buf + ret, log->buffer + off, first);
+		memcpy(buf + ret + first, log->buffer, len - first);
+		off = logger_offset(off + len);
+		ret += len;
+	}
+
+	return ret;
+}
+
+/*
+ * do_read_batch_to_user - stages a batch of entries in reader->batch_buf,
+ * drops log->mutex and copies the batch out, then advances the read head
+ * past the whole entries that reached user space. Returns the number of
+ * bytes read, or -EFAULT if not even one entry could be copied.
+ *
+ * Caller must hold log->mutex and reader->batch_lock; log->mutex is
+ * released on return.
+ */
+static ssize_t do_read_batch_to_user(struct logger_log *log,
+				     struct logger_reader *reader,
+				     char __user *buf, size_t count)
+{
+	size_t start = reader->r_off;
+	size_t staged, done, copied, end;
+	__u16 val;
+
+	staged = do_read_batch(log, start, reader->batch_buf,
+			       min_t(size_t, count, LOGGER_BATCH_LEN));
+	mutex_unlock(&log->mutex);
+
+	done = staged - copy_to_user(buf, reader->batch_buf, staged);
+
+	/* round down to whole entries */
+	for (copied = 0; copied < done; copied = end) {
+		memcpy(&val, reader->batch_buf + copied, sizeof(val));
+		end = copied + sizeof(struct logger_entry) + val;
+		if (end > done)
+			break;
+	}
+	if (!copied)
+		return -EFAULT;
+
+	/*
+	 * A writer that lapped us while the log was unlocked has pulled the
+	 * read head forward. Keep its position unless it is still inside the
+	 * batch we just returned.
+	 */
+	mutex_lock(&log->mutex);
+	end = logger_offset(start + copied);
+	if (reader->r_off == start || clock_interval(start, end, reader->r_off))
+		reader->r_off = end;
+	mutex_unlock(&log->mutex);
+
+	return copied;
+}
+
 /*
  * logger_read - our log's read() method
  *
@@ -148,7 +246,9 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or, after
+ * 	  LOGGER_SET_BATCH_READ, as many whole entries as fit in 'count'
+ * 	  (at most LOGGER_BATCH_LEN bytes)
  *
  * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -158,6 +258,7 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	char *batch_buf;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
@@ -188,11 +289,20 @@ start:
 	if (ret)
 		return ret;
 
+	/*
+	 * batch_buf is set once by LOGGER_SET_BATCH_READ and only freed on
+	 * release, so it can be sampled before taking the locks.
+	 */
+	batch_buf = reader->batch_buf;
+	if (batch_buf)
+		mutex_lock(&reader->batch_lock);
 	mutex_lock(&log->mutex);
 
 	/* is there still something to read or did we race? */
 	if (unlikely(log->w_off == reader->r_off)) {
 		mutex_unlock(&log->mutex);
+		if (batch_buf)
+			mutex_unlock(&reader->batch_lock);
 		goto start;
 	}
 
@@ -203,11 +313,20 @@ start:
 		goto out;
 	}
 
+	if (batch_buf && reader->batch) {
+		/* take every whole entry that fits, copy out unlocked */
+		ret = do_read_batch_to_user(log, reader, buf, count);
+		mutex_unlock(&reader->batch_lock);
+		return ret;
+	}
+
 	/* get exactly one entry from the log */
 	ret = do_read_log_to_user(log, reader, buf, ret);
 
 out:
 	mutex_unlock(&log->mutex);
+	if (batch_buf)
+		mutex_unlock(&reader->batch_lock);
 
 	return ret;
 }
@@ -231,23 +350,6 @@ static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 	return off;
 }
 
-/*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
- */
-static inline int clock_interval(size_t a, size_t b, size_t c)
-{
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
-	}
-
-	return 0;
-}
-
 /*
  * fix_up_readers - walk the list of all readers and "fix up" any who were
  * lapped by the writer; also do the same for the default "start head".
@@ -315,18 +417,51 @@ static ssize_t do_write_log_from_user(struct logger_log *log,
 	return count;
 }
 
+/*
+ * Payloads up to this size are staged on the writer's stack before taking
+ * log->mutex, which covers the common case of short log lines.
+ */
+#define LOGGER_STAGE_LEN	256
+
+/*
+ * stage_from_user - gathers 'count' bytes from the user-space vectors 'iov'
+ * into the kernel buffer 'stage'
+ *
+ * Returns 0 on success, negative error code on failure.
+ */
+static int stage_from_user(char *stage, const struct iovec *iov,
+			   unsigned long nr_segs, size_t count)
+{
+	while (nr_segs-- > 0 && count) {
+		size_t len = min_t(size_t, iov->iov_len, count);
+
+		if (copy_from_user(stage, iov->iov_base, len))
+			return -EFAULT;
+		stage += len;
+		count -= len;
+		iov++;
+	}
+
+	return 0;
+}
+
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * Short payloads are copied in from user space before log->mutex is taken,
+ * so that concurrent writers never wait on each other's page faults and the
+ * critical section is reduced to two memcpy()s.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	size_t orig;
 	struct logger_entry header;
 	struct timespec now;
+	char stage[LOGGER_STAGE_LEN];
 	ssize_t ret = 0;
 
 	now = current_kernel_time();
@@ -341,8 +476,16 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
+	if (header.len <= LOGGER_STAGE_LEN) {
+		ret = stage_from_user(stage, iov, nr_segs, header.len);
+		if (unlikely(ret))
+			return ret;
+	}
+
 	mutex_lock(&log->mutex);
 
+	orig = log->w_off;
+
 	/*
 	 * Fix up any readers, pulling them forward to the first readable
 	 * entry after (what will be) the new write offset. We do this now
@@ -353,6 +496,12 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 
 	do_write_log(log, &header, sizeof(struct logger_entry));
 
+	if (header.len <= LOGGER_STAGE_LEN) {
+		do_write_log(log, stage, header.len);
+		ret = header.len;
+		nr_segs = 0;
+	}
+
 	while (nr_segs-- > 0) {
 		size_t len;
 		ssize_t nr;
@@ -408,6 +557,9 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
+		reader->batch = 0;
+		reader->batch_buf = NULL;
+		mutex_init(&reader->batch_lock);
 		INIT_LIST_HEAD(&reader->list);
 
 		mutex_lock(&log->mutex);
@@ -432,6 +584,7 @@ static int logger_release(struct inode *ignored, struct file *file)
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
 		list_del(&reader->list);
+		kfree(reader->batch_buf);
 		kfree(reader);
 	}
 
@@ -513,6 +666,23 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		log->head = log->w_off;
 		ret = 0;
 		break;
+	case LOGGER_SET_BATCH_READ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		if (arg && !reader->batch_buf) {
+			reader->batch_buf = kmalloc(LOGGER_BATCH_LEN,
+						    GFP_KERNEL);
+			if (!reader->batch_buf) {
+				ret = -ENOMEM;
+				break;
+			}
+		}
+		reader->batch = !!arg;
+		ret = 0;
+		break;
 	}
 
 	mutex_unlock(&log->mutex);
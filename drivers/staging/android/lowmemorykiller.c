@@ -16,6 +16,11 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * A victim counts as outstanding until it has released its mm. While one
+ * is outstanding, no further task is killed unless max_victims is above 1
+ * and vmscan is failing to reclaim what it scans. Reading
+ * /dev/lowmemorykiller blocks until free memory drops below notify_minfree.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +40,13 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/ktime.h>
+#include <linux/vmstat.h>
+#include <linux/spinlock.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -52,8 +64,60 @@ static size_t lowmem_minfree[6] = {
 };
 static int lowmem_minfree_size = 4;
 
-static struct task_struct *lowmem_deathpending;
-static unsigned long lowmem_deathpending_timeout;
+/*
+ * Victims that have been sent SIGKILL but have not released their mm yet.
+ * A slot is retired when the victim's exit_mm() has run (checked from the
+ * shrinker), when its task_struct is freed, or after the HZ timeout.
+ * Slots are protected by lowmem_victim_lock, which is also taken from the
+ * task free notifier and so may nest inside softirq context.
+ */
+#define LOWMEM_MAX_VICTIMS 8
+
+struct lowmem_victim {
+	struct task_struct *task;
+	unsigned long start;
+};
+
+static struct lowmem_victim lowmem_victims[LOWMEM_MAX_VICTIMS];
+static DEFINE_SPINLOCK(lowmem_victim_lock);
+
+/*
+ * Up to lowmem_max_victims tasks may be killed in one pass, but only while
+ * vmscan is reclaiming less than lowmem_reclaim_ratio percent of the pages
+ * it scans; otherwise the killer stays one victim at a time.
+ */
+static int lowmem_max_victims = 1;
+static int lowmem_reclaim_ratio = 25;
+static unsigned long lowmem_last_scanned;
+static unsigned long lowmem_last_reclaimed;
+
+/*
+ * /dev/lowmemorykiller becomes readable when both free and file pages
+ * drop below lowmem_notify_minfree, so user-space can trim its caches
+ * before the kernel starts killing. 0 disables the notification.
+ */
+static size_t lowmem_notify_minfree;
+static unsigned int lowmem_notify_seq;
+static unsigned long lowmem_notify_last;
+static int lowmem_notify_free;
+static int lowmem_notify_file;
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_notify_wait);
+
+/*
+ * Statistics, exported read-only next to the tunables in
+ * /sys/module/lowmemorykiller/parameters. lowmem_pressure[i] counts the
+ * shrinker calls that found free memory below lowmem_minfree[i].
+ */
+static unsigned int lowmem_pressure[6];
+static unsigned int lowmem_scan_count;
+static unsigned int lowmem_scan_tasks;
+static unsigned int lowmem_scan_last_us;
+static unsigned int lowmem_scan_max_us;
+static unsigned int lowmem_kill_count;
+static unsigned int lowmem_kill_multi_count;
+static unsigned int lowmem_kill_timeout_count;
+static unsigned int lowmem_kill_latency_ms;
+static unsigned int lowmem_kill_latency_max_ms;
 
 #define lowmem_print(level, x...)			\
 	do {						\
@@ -68,41 +132,185 @@ static struct notifier_block task_nb = {
 	.notifier_call	= task_notify_func,
 };
 
+/* Called with lowmem_victim_lock held. */
+static void lowmem_victim_done(struct lowmem_victim *v)
+{
+	lowmem_kill_latency_ms = jiffies_to_msecs(jiffies - v->start);
+	if (lowmem_kill_latency_ms > lowmem_kill_latency_max_ms)
+		lowmem_kill_latency_max_ms = lowmem_kill_latency_ms;
+	v->task = NULL;
+}
+
+/*
+ * A task that was already sent SIGKILL keeps its mm until exit_mm(), so
+ * the scan would otherwise pick it again and count it twice.
+ */
+static int lowmem_victim_pending(struct task_struct *task)
+{
+	unsigned long flags;
+	int i, ret = 0;
+
+	if (test_tsk_thread_flag(task, TIF_MEMDIE) ||
+	    fatal_signal_pending(task))
+		return 1;
+
+	spin_lock_irqsave(&lowmem_victim_lock, flags);
+	for (i = 0; i < LOWMEM_MAX_VICTIMS; i++)
+		if (lowmem_victims[i].task == task)
+			ret = 1;
+	spin_unlock_irqrestore(&lowmem_victim_lock, flags);
+
+	return ret;
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
 	struct task_struct *task = data;
+	unsigned long flags;
+	int i;
 
-	if (task == lowmem_deathpending)
-		lowmem_deathpending = NULL;
+	spin_lock_irqsave(&lowmem_victim_lock, flags);
+	for (i = 0; i < LOWMEM_MAX_VICTIMS; i++)
+		if (lowmem_victims[i].task == task)
+			lowmem_victim_done(&lowmem_victims[i]);
+	spin_unlock_irqrestore(&lowmem_victim_lock, flags);
 
 	return NOTIFY_OK;
 }
 
+/*
+ * Retire victims whose mm has been released or whose timeout expired and
+ * return the number still outstanding.
+ */
+static int lowmem_victims_pending(void)
+{
+	unsigned long flags;
+	int pending = 0;
+	int i;
+
+	spin_lock_irqsave(&lowmem_victim_lock, flags);
+	for (i = 0; i < LOWMEM_MAX_VICTIMS; i++) {
+		struct lowmem_victim *v = &lowmem_victims[i];
+
+		if (!v->task)
+			continue;
+		if (!v->task->mm) {
+			lowmem_victim_done(v);
+		} else if (time_after(jiffies, v->start + HZ)) {
+			lowmem_kill_timeout_count++;
+			v->task = NULL;
+		} else {
+			pending++;
+		}
+	}
+	spin_unlock_irqrestore(&lowmem_victim_lock, flags);
+	return pending;
+}
+
+static void lowmem_victim_add(struct task_struct *task)
+{
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&lowmem_victim_lock, flags);
+	for (i = 0; i < LOWMEM_MAX_VICTIMS; i++) {
+		if (!lowmem_victims[i].task) {
+			lowmem_victims[i].task = task;
+			lowmem_victims[i].start = jiffies;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&lowmem_victim_lock, flags);
+}
+
+/*
+ * Shrinkers are not told the vmscan priority, so estimate how hard
+ * reclaim is struggling from the pgscan and pgsteal event counters since
+ * the previous call. Returns true when less than lowmem_reclaim_ratio
+ * percent of the scanned pages were reclaimed.
+ */
+static bool lowmem_reclaim_struggling(void)
+{
+#ifdef CONFIG_VM_EVENT_COUNTERS
+	unsigned long events[NR_VM_EVENT_ITEMS];
+	unsigned long scanned = 0;
+	unsigned long reclaimed = 0;
+	unsigned long d_scanned, d_reclaimed;
+	int i;
+
+	all_vm_events(events);
+	for (i = PGREFILL_MOVABLE + 1; i <= PGSTEAL_MOVABLE; i++)
+		reclaimed += events[i];
+	for (i = PGSTEAL_MOVABLE + 1; i <= PGSCAN_DIRECT_MOVABLE; i++)
+		scanned += events[i];
+
+	d_scanned = scanned - lowmem_last_scanned;
+	d_reclaimed = reclaimed - lowmem_last_reclaimed;
+	lowmem_last_scanned = scanned;
+	lowmem_last_reclaimed = reclaimed;
+
+	if (!d_scanned)
+		return false;
+	return d_reclaimed * 100 < d_scanned * lowmem_reclaim_ratio;
+#else
+	return false;
+#endif
+}
+
+static void lowmem_notify(int other_free, int other_file)
+{
+	if (!lowmem_notify_minfree ||
+	    other_free >= lowmem_notify_minfree ||
+	    other_file >= lowmem_notify_minfree)
+		return;
+	if (lowmem_notify_seq &&
+	    time_before(jiffies, lowmem_notify_last + HZ / 10))
+		return;
+	lowmem_notify_last = jiffies;
+	lowmem_notify_free = other_free;
+	lowmem_notify_file = other_file;
+	lowmem_notify_seq++;
+	wake_up_interruptible(&lowmem_notify_wait);
+}
+
 static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 {
 	struct task_struct *p;
-	struct task_struct *selected = NULL;
+	struct task_struct *selected[LOWMEM_MAX_VICTIMS];
+	int selected_tasksize[LOWMEM_MAX_VICTIMS];
+	int selected_adj[LOWMEM_MAX_VICTIMS];
+	int nr_selected = 0;
 	int rem = 0;
 	int tasksize;
-	int i;
+	int i, j;
 	int min_adj = OOM_ADJUST_MAX + 1;
-	int selected_tasksize = 0;
-	int selected_oom_adj;
+	int level = -1;
+	int max_victims;
+	int pending;
+	int budget;
+	int shortfall;
+	int freed;
+	int threshold_adj;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
 						global_page_state(NR_SHMEM);
+	int scanned = 0;
+	ktime_t start;
+	unsigned int scan_us;
+
+	lowmem_notify(other_free, other_file);
+
+	max_victims = clamp(lowmem_max_victims, 1, LOWMEM_MAX_VICTIMS);
 
 	/*
-	 * If we already have a death outstanding, then
-	 * bail out right away; indicating to vmscan
-	 * that we have nothing further to offer on
-	 * this pass.
-	 *
+	 * If we already have as many deaths outstanding as we are allowed,
+	 * then bail out right away; indicating to vmscan that we have
+	 * nothing further to offer on this pass.
 	 */
-	if (lowmem_deathpending &&
-	    time_before_eq(jiffies, lowmem_deathpending_timeout))
+	pending = lowmem_victims_pending();
+	if (pending >= max_victims)
 		return 0;
 
 	if (lowmem_adj_size < array_size)
@@ -113,6 +321,8 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 		if (other_free < lowmem_minfree[i] &&
 		    other_file < lowmem_minfree[i]) {
 			min_adj = lowmem_adj[i];
+			level = i;
+			lowmem_pressure[i]++;
 			break;
 		}
 	}
@@ -129,14 +339,47 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 			     nr_to_scan, gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
 
+	/*
+	 * One victim at a time unless reclaim is failing to keep up, in
+	 * which case kill enough to cover the shortfall to the minfree
+	 * level in a single pass.
+	 */
+	budget = 1;
+	if (max_victims > 1 && lowmem_reclaim_struggling())
+		budget = max_victims;
+	else if (pending)
+		return 0;
+	budget -= pending;
+	shortfall = lowmem_minfree[level] - max(other_free, other_file);
+
+	start = ktime_get();
 	read_lock(&tasklist_lock);
 	for_each_process(p) {
 		struct mm_struct *mm;
 		struct signal_struct *sig;
 		int oom_adj;
 
+		/*
+		 * Once the candidate list is full, tasks below its weakest
+		 * entry can never be selected.
+		 */
+		threshold_adj = nr_selected < budget ? min_adj :
+					selected_adj[nr_selected - 1];
+
+		/*
+		 * Kernel threads and tasks below the threshold are rejected
+		 * before taking the task lock and summing the rss counters.
+		 * The unlocked peek is only a hint, the values are rechecked
+		 * under task_lock().
+		 */
+		sig = p->signal;
+		if (!p->mm || !sig || sig->oom_adj < threshold_adj)
+			continue;
+		if (lowmem_victim_pending(p))
+			continue;
+
+		scanned++;
 		task_lock(p);
 		mm = p->mm;
 		sig = p->signal;
@@ -145,7 +388,7 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 			continue;
 		}
 		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
+		if (oom_adj < threshold_adj) {
 			task_unlock(p);
 			continue;
 		}
@@ -153,31 +396,54 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 		task_unlock(p);
 		if (tasksize <= 0)
 			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
+
+		/* Keep selected[] ordered by oom_adj, then by size. */
+		for (i = 0; i < nr_selected; i++) {
+			if (oom_adj > selected_adj[i] ||
+			    (oom_adj == selected_adj[i] &&
+			     tasksize > selected_tasksize[i]))
+				break;
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
+		if (i >= budget)
+			continue;
+		if (nr_selected < budget)
+			nr_selected++;
+		for (j = nr_selected - 1; j > i; j--) {
+			selected[j] = selected[j - 1];
+			selected_tasksize[j] = selected_tasksize[j - 1];
+			selected_adj[j] = selected_adj[j - 1];
+		}
+		selected[i] = p;
+		selected_tasksize[i] = tasksize;
+		selected_adj[i] = oom_adj;
 		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
 			     p->pid, p->comm, oom_adj, tasksize);
 	}
-	if (selected) {
+	freed = 0;
+	for (i = 0; i < nr_selected; i++) {
+		if (i && freed >= shortfall)
+			break;
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		lowmem_deathpending_timeout = jiffies + HZ;
-		force_sig(SIGKILL, selected);
-		rem -= selected_tasksize;
+			     selected[i]->pid, selected[i]->comm,
+			     selected_adj[i], selected_tasksize[i]);
+		lowmem_victim_add(selected[i]);
+		force_sig(SIGKILL, selected[i]);
+		lowmem_kill_count++;
+		if (i)
+			lowmem_kill_multi_count++;
+		freed += selected_tasksize[i];
 	}
+	rem -= freed;
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
 	read_unlock(&tasklist_lock);
+
+	scan_us = ktime_to_us(ktime_sub(ktime_get(), start));
+	lowmem_scan_count++;
+	lowmem_scan_tasks += scanned;
+	lowmem_scan_last_us = scan_us;
+	if (scan_us > lowmem_scan_max_us)
+		lowmem_scan_max_us = scan_us;
 	return rem;
 }
 
@@ -186,8 +452,73 @@ static struct shrinker lowmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+static int lowmem_notify_open(struct inode *inode, struct file *file)
+{
+	file->private_data = (void *)(unsigned long)lowmem_notify_seq;
+	return nonseekable_open(inode, file);
+}
+
+static unsigned int lowmem_notify_poll(struct file *file, poll_table *wait)
+{
+	unsigned int seen = (unsigned long)file->private_data;
+
+	poll_wait(file, &lowmem_notify_wait, wait);
+	if (lowmem_notify_seq != seen)
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+/*
+ * Each read blocks until the next low memory event and returns a line
+ * "<free pages> <file pages>" describing it.
+ */
+static ssize_t lowmem_notify_read(struct file *file, char __user *buf,
+				  size_t count, loff_t *pos)
+{
+	unsigned int seen = (unsigned long)file->private_data;
+	char tmp[32];
+	int len;
+	int ret;
+
+	if (lowmem_notify_seq == seen) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(lowmem_notify_wait,
+					       lowmem_notify_seq != seen);
+		if (ret)
+			return ret;
+	}
+	file->private_data = (void *)(unsigned long)lowmem_notify_seq;
+
+	len = snprintf(tmp, sizeof(tmp), "%d %d\n",
+		       lowmem_notify_free, lowmem_notify_file);
+	if (len > count)
+		return -EINVAL;
+	if (copy_to_user(buf, tmp, len))
+		return -EFAULT;
+	return len;
+}
+
+static const struct file_operations lowmem_notify_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_notify_open,
+	.poll = lowmem_notify_poll,
+	.read = lowmem_notify_read,
+};
+
+static struct miscdevice lowmem_notify_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "lowmemorykiller",
+	.fops = &lowmem_notify_fops
+};
+
 static int __init lowmem_init(void)
 {
+	int ret;
+
+	ret = misc_register(&lowmem_notify_miscdev);
+	if (ret)
+		return ret;
 	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
 	return 0;
@@ -197,6 +528,7 @@ static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
 	task_free_unregister(&task_nb);
+	misc_deregister(&lowmem_notify_miscdev);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -205,9 +537,24 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(max_victims, lowmem_max_victims, int, S_IRUGO | S_IWUSR);
+module_param_named(reclaim_ratio, lowmem_reclaim_ratio, int,
+		   S_IRUGO | S_IWUSR);
+module_param_named(notify_minfree, lowmem_notify_minfree, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_array_named(pressure, lowmem_pressure, uint, NULL, S_IRUGO);
+module_param_named(scans, lowmem_scan_count, uint, S_IRUGO);
+module_param_named(scanned_tasks, lowmem_scan_tasks, uint, S_IRUGO);
+module_param_named(scan_last_us, lowmem_scan_last_us, uint, S_IRUGO);
+module_param_named(scan_max_us, lowmem_scan_max_us, uint, S_IRUGO);
+module_param_named(kills, lowmem_kill_count, uint, S_IRUGO);
+module_param_named(multi_kills, lowmem_kill_multi_count, uint, S_IRUGO);
+module_param_named(kill_timeouts, lowmem_kill_timeout_count, uint, S_IRUGO);
+module_param_named(kill_latency_ms, lowmem_kill_latency_ms, uint, S_IRUGO);
+module_param_named(kill_latency_max_ms, lowmem_kill_latency_max_ms, uint,
+		   S_IRUGO);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
 
 MODULE_LICENSE("GPL");
-
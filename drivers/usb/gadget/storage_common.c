@@ -644,6 +644,12 @@ static int fsg_lun_open(struct fsg_lun *curlun, const char *filename)
 		goto out;
 	}
 
+	/*
+	 * Hosts mostly issue long sequential READs to a mass storage disk,
+	 * so double the device's read-ahead window for this file.
+	 */
+	filp->f_ra.ra_pages = filp->f_mapping->backing_dev_info->ra_pages * 2;
+
 	get_file(filp);
 	curlun->ro = ro;
 	curlun->filp = filp;
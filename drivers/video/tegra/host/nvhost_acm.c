@@ -25,22 +25,98 @@
 #include <linux/sched.h>
 #include <linux/err.h>
 #include <linux/device.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
 
+/*
+ * The powerdown delay is picked from each module's recent idle periods.
+ * When ACM_HOLD_PERCENT of them ended within ACM_TIMEOUT_MAX_MSEC (frames
+ * arriving in bursts), the module is held up just long enough to ride
+ * through them rather than toggling clocks every frame. When idle periods
+ * are mostly long, it is powered down after ACM_TIMEOUT_MIN_MSEC. Until
+ * ACM_MIN_SAMPLES have been seen the old fixed delay is used.
+ */
 #define ACM_TIMEOUT_MSEC 25
+#define ACM_TIMEOUT_MIN_MSEC 2
+#define ACM_TIMEOUT_MAX_MSEC 64
+#define ACM_HOLD_PERCENT 75
+#define ACM_MIN_SAMPLES 8
+#define ACM_HIST_WINDOW 64
+
+static void record_idle_period(struct nvhost_module *mod, s64 idle_us)
+{
+	unsigned int ms = (unsigned int)min_t(s64,
+				div_s64(idle_us, USEC_PER_MSEC), UINT_MAX);
+	unsigned int total = 0;
+	int i;
+
+	i = min(ms ? fls(ms) : 0, NVHOST_MODULE_IDLE_BUCKETS - 1);
+	mod->idle_hist[i]++;
+
+	for (i = 0; i < NVHOST_MODULE_IDLE_BUCKETS; i++)
+		total += mod->idle_hist[i];
+
+	/* age the history so the policy follows changes in workload */
+	if (total >= ACM_HIST_WINDOW)
+		for (i = 0; i < NVHOST_MODULE_IDLE_BUCKETS; i++)
+			mod->idle_hist[i] >>= 1;
+}
+
+static unsigned int powerdown_delay(struct nvhost_module *mod)
+{
+	unsigned int total = 0;
+	unsigned int sum = 0;
+	int i;
+
+	for (i = 0; i < NVHOST_MODULE_IDLE_BUCKETS; i++)
+		total += mod->idle_hist[i];
+	if (total < ACM_MIN_SAMPLES)
+		return ACM_TIMEOUT_MSEC;
+
+	for (i = 0; i < NVHOST_MODULE_IDLE_BUCKETS - 1; i++) {
+		sum += mod->idle_hist[i];
+		if (sum * 100 >= total * ACM_HOLD_PERCENT)
+			break;
+	}
+
+	/* bucket i holds idle periods shorter than 2^i ms */
+	if (i == NVHOST_MODULE_IDLE_BUCKETS - 1 ||
+	    (1 << i) > ACM_TIMEOUT_MAX_MSEC)
+		return ACM_TIMEOUT_MIN_MSEC;
+	return max(1 << i, ACM_TIMEOUT_MIN_MSEC);
+}
 
 void nvhost_module_busy(struct nvhost_module *mod)
 {
 	mutex_lock(&mod->lock);
 	cancel_delayed_work(&mod->powerdown);
-	if ((atomic_inc_return(&mod->refcount) == 1) && !mod->powered) {
-		int i;
-		if (mod->parent)
-			nvhost_module_busy(mod->parent);
-		for (i = 0; i < mod->num_clks; i++)
-			clk_enable(mod->clk[i]);
-		if (mod->func)
-			mod->func(mod, NVHOST_POWER_ACTION_ON);
-		mod->powered = true;
+	if (atomic_inc_return(&mod->refcount) == 1) {
+		ktime_t now = ktime_get();
+
+		if (mod->last_idle.tv64) {
+			s64 idle = ktime_us_delta(now, mod->last_idle);
+			mod->idle_us += idle;
+			record_idle_period(mod, idle);
+		}
+		mod->last_busy = now;
+
+		if (mod->powered) {
+			/* the powerdown delay saved a clock toggle */
+			mod->kept_on++;
+		} else {
+			int i;
+			if (mod->parent)
+				nvhost_module_busy(mod->parent);
+			for (i = 0; i < mod->num_clks; i++)
+				clk_enable(mod->clk[i]);
+			if (mod->func)
+				mod->func(mod, NVHOST_POWER_ACTION_ON);
+			mod->powered = true;
+			mod->powerups++;
+			if (mod->last_off.tv64)
+				mod->off_us += ktime_us_delta(now,
+							mod->last_off);
+		}
 	}
 	mutex_unlock(&mod->lock);
 }
@@ -57,6 +133,8 @@ static void powerdown_handler(struct work_struct *work)
 		for (i = 0; i < mod->num_clks; i++)
 			clk_disable(mod->clk[i]);
 		mod->powered = false;
+		mod->powerdowns++;
+		mod->last_off = ktime_get();
 		if (mod->parent)
 			nvhost_module_idle(mod->parent);
 	}
@@ -70,8 +148,13 @@ void nvhost_module_idle_mult(struct nvhost_module *mod, int refs)
 	mutex_lock(&mod->lock);
 	if (atomic_sub_return(refs, &mod->refcount) == 0) {
 		BUG_ON(!mod->powered);
-		schedule_delayed_work(
-			&mod->powerdown, msecs_to_jiffies(ACM_TIMEOUT_MSEC));
+		mod->last_idle = ktime_get();
+		if (mod->last_busy.tv64)
+			mod->busy_us += ktime_us_delta(mod->last_idle,
+						mod->last_busy);
+		mod->powerdown_delay = powerdown_delay(mod);
+		schedule_delayed_work(&mod->powerdown,
+				msecs_to_jiffies(mod->powerdown_delay));
 		kick = true;
 	}
 	mutex_unlock(&mod->lock);
@@ -118,6 +201,10 @@ int nvhost_module_init(struct nvhost_module *mod, const char *name,
 	mod->func = func;
 	mod->parent = parent;
 	mod->powered = false;
+	mod->powerdown_delay = ACM_TIMEOUT_MSEC;
+	mod->last_busy = ktime_set(0, 0);
+	mod->last_idle = ktime_set(0, 0);
+	mod->last_off = ktime_set(0, 0);
 	mutex_init(&mod->lock);
 	init_waitqueue_head(&mod->idle);
 	INIT_DELAYED_WORK(&mod->powerdown, powerdown_handler);
@@ -148,3 +235,23 @@ void nvhost_module_deinit(struct nvhost_module *mod)
 	for (i = 0; i < mod->num_clks; i++)
 		clk_put(mod->clk[i]);
 }
+
+void nvhost_module_debug_show(struct seq_file *s, struct nvhost_module *mod,
+		const char *name)
+{
+	int i;
+
+	mutex_lock(&mod->lock);
+	seq_printf(s, "%-8s %s refs %d delay %ums up %lu down %lu kept %lu\n",
+		name, mod->powered ? "on " : "off",
+		atomic_read(&mod->refcount), mod->powerdown_delay,
+		mod->powerups, mod->powerdowns, mod->kept_on);
+	seq_printf(s, "         busy %llums idle %llums off %llums hist",
+		div_u64(mod->busy_us, USEC_PER_MSEC),
+		div_u64(mod->idle_us, USEC_PER_MSEC),
+		div_u64(mod->off_us, USEC_PER_MSEC));
+	for (i = 0; i < NVHOST_MODULE_IDLE_BUCKETS; i++)
+		seq_printf(s, " %u", mod->idle_hist[i]);
+	seq_printf(s, "\n");
+	mutex_unlock(&mod->lock);
+}
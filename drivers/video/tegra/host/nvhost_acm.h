@@ -27,8 +27,10 @@
 #include <linux/wait.h>
 #include <linux/mutex.h>
 #include <linux/clk.h>
+#include <linux/ktime.h>
 
 #define NVHOST_MODULE_MAX_CLOCKS 2
+#define NVHOST_MODULE_IDLE_BUCKETS 8
 
 struct nvhost_module;
 
@@ -50,6 +52,19 @@ struct nvhost_module {
 	atomic_t refcount;
 	wait_queue_head_t idle;
 	struct nvhost_module *parent;
+
+	/* idle period history, log2 milliseconds: <1, <2, <4 ... >=64 */
+	unsigned int idle_hist[NVHOST_MODULE_IDLE_BUCKETS];
+	unsigned int powerdown_delay;
+	ktime_t last_busy;
+	ktime_t last_idle;
+	ktime_t last_off;
+	u64 busy_us;
+	u64 idle_us;
+	u64 off_us;
+	unsigned long powerups;
+	unsigned long powerdowns;
+	unsigned long kept_on;
 };
 
 int nvhost_module_init(struct nvhost_module *mod, const char *name,
@@ -61,6 +76,10 @@ void nvhost_module_suspend(struct nvhost_module *mod);
 void nvhost_module_busy(struct nvhost_module *mod);
 void nvhost_module_idle_mult(struct nvhost_module *mod, int refs);
 
+struct seq_file;
+void nvhost_module_debug_show(struct seq_file *s, struct nvhost_module *mod,
+		const char *name);
+
 static inline bool nvhost_module_powered(struct nvhost_module *mod)
 {
 	return mod->powered;
@@ -94,6 +94,8 @@ static int nvhost_channelopen(struct inode *inode, struct file *filp)
 	}
 	filp->private_data = priv;
 	priv->ch = ch;
+	/* leave room for ctx switch */
+	priv->num_gathers = 2;
 	priv->gather_mem = nvmap_alloc(
 		sizeof(struct nvhost_op_pair) * NVHOST_MAX_GATHERS, 32,
 		NVMEM_HANDLE_CACHEABLE, (void**)&priv->gathers);
@@ -128,6 +130,40 @@ static void reset_submit(struct nvhost_channel_userctx *ctx)
 {
 	ctx->cmdbufs_pending = 0;
 	ctx->relocs_pending = 0;
+	ctx->syncpt_incrs = 0;
+	/* leave room for ctx switch */
+	ctx->num_gathers = 2;
+	ctx->pinarray_size = 0;
+}
+
+/*
+ * Start a new submit, or append one to the submits already written since
+ * the last flush. Appended submits must use the same syncpt and kickoff
+ * mode; their increments are summed so the whole batch goes to the channel
+ * with a single pin, cdma kick and completion interrupt.
+ */
+static int begin_submit(struct nvhost_channel_userctx *ctx,
+		struct nvhost_submit_hdr *hdr)
+{
+	if (!hdr->num_cmdbufs)
+		return -EFAULT;
+
+	if (ctx->num_gathers > 2 &&
+	    (hdr->syncpt_id != ctx->syncpt_id ||
+	     hdr->null_kickoff != ctx->null_kickoff))
+		return -EINVAL;
+
+	if (ctx->num_gathers + hdr->num_cmdbufs > NVHOST_MAX_GATHERS ||
+	    ctx->pinarray_size + hdr->num_cmdbufs + hdr->num_relocs >
+			NVHOST_MAX_HANDLES)
+		return -E2BIG;
+
+	ctx->syncpt_id = hdr->syncpt_id;
+	ctx->syncpt_incrs += hdr->syncpt_incrs;
+	ctx->cmdbufs_pending = hdr->num_cmdbufs;
+	ctx->relocs_pending = hdr->num_relocs;
+	ctx->null_kickoff = hdr->null_kickoff;
+	return 0;
 }
 
 static ssize_t nvhost_channelwrite(struct file *filp, const char __user *buf,
@@ -140,20 +176,17 @@ static ssize_t nvhost_channelwrite(struct file *filp, const char __user *buf,
 	while (remaining) {
 		size_t consumed;
 		if (!priv->relocs_pending && !priv->cmdbufs_pending) {
-			consumed = sizeof(struct nvhost_submit_hdr);
+			struct nvhost_submit_hdr hdr;
+			consumed = sizeof(hdr);
 			if (remaining < consumed)
 				break;
-			if (copy_from_user(&priv->syncpt_id, buf, consumed)) {
+			if (copy_from_user(&hdr, buf, consumed)) {
 				err = -EFAULT;
 				break;
 			}
-			if (!priv->cmdbufs_pending) {
-				err = -EFAULT;
+			err = begin_submit(priv, &hdr);
+			if (err)
 				break;
-			}
-			/* leave room for ctx switch */
-			priv->num_gathers = 2;
-			priv->pinarray_size = 0;
 		} else if (priv->cmdbufs_pending) {
 			struct nvhost_cmdbuf cmdbuf;
 			consumed = sizeof(cmdbuf);
@@ -230,6 +263,7 @@ static int nvhost_ioctl_channel_flush(
 	if (err) {
 		dev_warn(&ctx->ch->dev->pdev->dev, "nvmap_pin_array failed: %d\n", err);
 		nvhost_module_idle(&ctx->ch->mod);
+		reset_submit(ctx);
 		return err;
 	}
 
@@ -296,6 +330,7 @@ static int nvhost_ioctl_channel_flush(
 			NVHOST_INTR_ACTION_SUBMIT_COMPLETE, ctx->ch, NULL);
 
 	mutex_unlock(&ctx->ch->submitlock);
+	reset_submit(ctx);
 	args->value = syncval;
 	return 0;
 }
@@ -649,6 +684,51 @@ fail:
 	return err;
 }
 
+#ifdef CONFIG_DEBUG_FS
+
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+static int nvhost_acm_show(struct seq_file *s, void *unused)
+{
+	struct nvhost_dev *host = s->private;
+	int i;
+
+	nvhost_module_debug_show(s, &host->mod, "host1x");
+	for (i = 0; i < NVHOST_NUMCHANNELS; i++) {
+		struct nvhost_channel *ch = &host->channels[i];
+		/* module state only exists while the channel is open */
+		mutex_lock(&ch->reflock);
+		if (ch->refcount)
+			nvhost_module_debug_show(s, &ch->mod, ch->desc->name);
+		mutex_unlock(&ch->reflock);
+	}
+	return 0;
+}
+
+static int nvhost_acm_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nvhost_acm_show, inode->i_private);
+}
+
+static const struct file_operations nvhost_acm_fops = {
+	.open		= nvhost_acm_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void __init nvhost_debug_init(struct nvhost_dev *host)
+{
+	(void) debugfs_create_file("nvhost_acm", S_IRUGO,
+					NULL, host, &nvhost_acm_fops);
+}
+#else
+static void __init nvhost_debug_init(struct nvhost_dev *host)
+{
+}
+#endif
+
 static int __init nvhost_probe(struct platform_device *pdev)
 {
 	struct nvhost_dev *host;
@@ -711,6 +791,8 @@ static int __init nvhost_probe(struct platform_device *pdev)
 	nvhost_syncpt_reset(&host->syncpt);
 	clk_disable(host->mod.clk[0]);
 
+	nvhost_debug_init(host);
+
 	dev_info(&pdev->dev, "initialized\n");
 	return 0;
 
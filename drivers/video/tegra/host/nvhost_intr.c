@@ -230,12 +230,17 @@ static void run_handlers(struct list_head completed[NVHOST_INTR_ACTION_COUNT])
 
 /**
  * Remove & handle all waiters that have completed for the given syncpt
+ *
+ * The syncpt value is re-read before the threshold is re-armed, so waiters
+ * whose threshold passed while the list was being processed are collected
+ * in the same pass instead of each taking another interrupt.
  */
 int process_wait_list(struct nvhost_intr_syncpt *syncpt,
-		u32 threshold, void __iomem *sync_regs)
+		struct nvhost_syncpt *sp, void __iomem *sync_regs)
 {
 	struct list_head completed[NVHOST_INTR_ACTION_COUNT];
 	unsigned int i;
+	u32 threshold;
 	int empty;
 
 	for (i = 0; i < NVHOST_INTR_ACTION_COUNT; ++i)
@@ -243,12 +248,26 @@ int process_wait_list(struct nvhost_intr_syncpt *syncpt,
 
 	spin_lock(&syncpt->lock);
 
-	remove_completed_waiters(&syncpt->wait_head, threshold, completed);
+	threshold = nvhost_syncpt_update_min(sp, syncpt->id);
+	for (;;) {
+		u32 next;
+
+		remove_completed_waiters(&syncpt->wait_head, threshold,
+					completed);
+
+		empty = list_empty(&syncpt->wait_head);
+		if (empty)
+			break;
 
-	empty = list_empty(&syncpt->wait_head);
-	if (!empty)
-		reset_threshold_interrupt(&syncpt->wait_head,
-					syncpt->id, sync_regs);
+		next = list_first_entry(&syncpt->wait_head,
+					struct nvhost_waitlist, list)->thresh;
+		threshold = nvhost_syncpt_update_min(sp, syncpt->id);
+		if ((s32)(threshold - next) < 0) {
+			reset_threshold_interrupt(&syncpt->wait_head,
+						syncpt->id, sync_regs);
+			break;
+		}
+	}
 
 	spin_unlock(&syncpt->lock);
 
@@ -292,9 +311,7 @@ static irqreturn_t syncpt_thresh_fn(int irq, void *dev_id)
 						syncpt[id]);
 	struct nvhost_dev *dev = intr_to_dev(intr);
 
-	(void)process_wait_list(syncpt,
-			nvhost_syncpt_update_min(&dev->syncpt, id),
-			dev->sync_aperture);
+	(void)process_wait_list(syncpt, &dev->syncpt, dev->sync_aperture);
 
 	return IRQ_HANDLED;
 }
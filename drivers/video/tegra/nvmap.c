@@ -47,7 +47,9 @@
 #include <linux/nvmap.h>
 #include <linux/debugfs.h>
 #include <linux/seq_file.h>
+#include <linux/workqueue.h>
 #include <asm/tlbflush.h>
+#include <asm/cacheflush.h>
 #include <mach/iovmm.h>
 #include "nvcommon.h"
 #include "nvrm_memmgr.h"
@@ -139,16 +141,54 @@ static DECLARE_WAIT_QUEUE_HEAD(nvmap_ptefull);
 /* used to lost the master tree of memory handles */
 static DEFINE_SPINLOCK(nvmap_handle_lock);
 
-/* only one task may be performing pin / unpin operations at once, to
- * prevent deadlocks caused by interleaved IOVMM re-allocations */
+/* only one task may be allocating IOVMM areas for a pin stream at once,
+ * to prevent deadlocks caused by interleaved IOVMM re-allocations. pins
+ * which need no allocation (see _nvmap_handle_pin_resident) skip it */
 static DEFINE_MUTEX(nvmap_pin_lock);
 
 /* queue of tasks which are blocking on pin, for IOVMM room */
 static DECLARE_WAIT_QUEUE_HEAD(nvmap_pin_wait);
+
+/* pin cache statistics: pins that found their IOVMM area resident, pins
+ * that had to allocate one, areas reclaimed from unpinned handles, array
+ * pins restarted under nvmap_pin_lock, and the number and total duration
+ * of waits for IOVMM room */
+static unsigned int nvmap_pin_hits;
+static unsigned int nvmap_pin_misses;
+static unsigned int nvmap_pin_evictions;
+static unsigned int nvmap_pin_restarts;
+static unsigned int nvmap_pin_waits;
+static unsigned int nvmap_pin_wait_us;
+module_param_named(pin_hits, nvmap_pin_hits, uint, 0444);
+module_param_named(pin_misses, nvmap_pin_misses, uint, 0444);
+module_param_named(pin_evictions, nvmap_pin_evictions, uint, 0444);
+module_param_named(pin_restarts, nvmap_pin_restarts, uint, 0444);
+module_param_named(pin_waits, nvmap_pin_waits, uint, 0444);
+module_param_named(pin_wait_us, nvmap_pin_wait_us, uint, 0444);
 static struct rb_root nvmap_handles = RB_ROOT;
 
 static struct tegra_iovmm_client *nvmap_vm_client = NULL;
 
+/* cap on the I/O virtual address space nvmap's IOVMM client may have
+ * allocated at once, in bytes; 0 for no cap. once it is reached, pins
+ * reclaim unpinned areas or wait, exactly as when the IOVMM is full */
+static unsigned int nvmap_iovmm_quota;
+
+static int nvmap_set_iovmm_quota(const char *val, struct kernel_param *kp)
+{
+	int ret = param_set_uint(val, kp);
+	if (ret) return ret;
+
+	mutex_lock(&nvmap_pin_lock);
+	if (nvmap_vm_client)
+		tegra_iovmm_client_set_quota(nvmap_vm_client,
+			nvmap_iovmm_quota);
+	mutex_unlock(&nvmap_pin_lock);
+	return 0;
+}
+module_param_call(iovmm_quota, nvmap_set_iovmm_quota, param_get_uint,
+	&nvmap_iovmm_quota, 0644);
+
 /* default heap order policy */
 static unsigned int _nvmap_heap_policy (unsigned int heaps, int numpages)
 {
@@ -179,7 +219,16 @@ static unsigned int _nvmap_heap_policy (unsigned int heaps, int numpages)
 	return 0;
 };
 
-/* first-fit linear allocator carveout heap manager */
+/* segregated-fit carveout heap manager
+ *
+ * free blocks are kept on NVMAP_FREE_CLASSES lists, where class c holds
+ * blocks of at least 2^(c-1) and less than 2^c pages (class 0 holds the
+ * sub-page blocks, the last class everything larger). top-down allocations
+ * start at the class of the requested size and take the first block that
+ * fits, which approximates best-fit without walking every free block and
+ * keeps small requests from splitting the large blocks. */
+#define NVMAP_FREE_CLASSES	16
+
 struct nvmap_mem_block {
 	struct nvmap_handle *h; /* backlink to handle for compaction */
 	unsigned long	base;
@@ -190,6 +239,7 @@ struct nvmap_mem_block {
 	short		prev; /* previous absolute (address-order) block */
 	short		next_free;
 	short		prev_free;
+	signed char	free_class; /* free list, or -1 if not free */
 
 	/* debugfs realted */
 	ktime_t		time;
@@ -205,7 +255,7 @@ struct nvmap_mem_block {
 struct nvmap_carveout {
 	unsigned short		num_blocks;
 	short			spare_index;
-	short			free_index;
+	short			free_index[NVMAP_FREE_CLASSES];
 	short			block_index;
 	spinlock_t		lock;
 	const char		*name;
@@ -244,6 +294,7 @@ static unsigned long _nvmap_carveout_blockstat(struct nvmap_carveout *co,
 {
 	unsigned long val = 0;
 	short idx;
+	int c;
 	spin_lock(&co->lock);
 
 	if (stat==CARVEOUT_STAT_BASE) {
@@ -257,46 +308,56 @@ static unsigned long _nvmap_carveout_blockstat(struct nvmap_carveout *co,
 
 	if (stat==CARVEOUT_STAT_TOTAL_SIZE ||
 	    stat==CARVEOUT_STAT_NUM_BLOCKS ||
-	    stat==CARVEOUT_STAT_LARGEST_BLOCK)
+	    stat==CARVEOUT_STAT_LARGEST_BLOCK) {
 		idx = co->block_index;
-	else
-		idx = co->free_index;
-
-	while (idx!=-1) {
-		switch (stat) {
-		case CARVEOUT_STAT_TOTAL_SIZE:
-			val += co->blocks[idx].size;
-			idx = co->blocks[idx].next;
-			break;
-		case CARVEOUT_STAT_NUM_BLOCKS:
-			val++;
-			idx = co->blocks[idx].next;
-			break;
-		case CARVEOUT_STAT_LARGEST_BLOCK:
-			val = max_t(unsigned long, val, co->blocks[idx].size);
+		while (idx!=-1) {
+			switch (stat) {
+			case CARVEOUT_STAT_TOTAL_SIZE:
+				val += co->blocks[idx].size;
+				break;
+			case CARVEOUT_STAT_NUM_BLOCKS:
+				val++;
+				break;
+			case CARVEOUT_STAT_LARGEST_BLOCK:
+				val = max_t(unsigned long, val,
+					    co->blocks[idx].size);
+				break;
+			}
 			idx = co->blocks[idx].next;
-			break;
-		case CARVEOUT_STAT_FREE_SIZE:
-			val += co->blocks[idx].size;
-			idx = co->blocks[idx].next_free;
-			break;
-		case CARVEOUT_STAT_FREE_BLOCKS:
-			val ++;
-			idx = co->blocks[idx].next_free;
-			break;
-		case CARVEOUT_STAT_LARGEST_FREE:
-			val = max_t(unsigned long, val, co->blocks[idx].size);
+		}
+		spin_unlock(&co->lock);
+		return val;
+	}
+
+	for (c=0; c<NVMAP_FREE_CLASSES; c++) {
+		idx = co->free_index[c];
+		while (idx!=-1) {
+			switch (stat) {
+			case CARVEOUT_STAT_FREE_SIZE:
+				val += co->blocks[idx].size;
+				break;
+			case CARVEOUT_STAT_FREE_BLOCKS:
+				val++;
+				break;
+			case CARVEOUT_STAT_LARGEST_FREE:
+				val = max_t(unsigned long, val,
+					    co->blocks[idx].size);
+				break;
+			}
 			idx = co->blocks[idx].next_free;
-			break;
-	    }
+		}
 	}
 
 	spin_unlock(&co->lock);
 	return val;
 }
 
-#define co_is_free(_co, _idx) \
-	((_co)->free_index==(_idx) || ((_co)->blocks[(_idx)].prev_free!=-1))
+#define co_is_free(_co, _idx) ((_co)->blocks[(_idx)].free_class!=-1)
+
+static inline int nvmap_free_class(size_t size)
+{
+	return min_t(int, fls(size >> PAGE_SHIFT), NVMAP_FREE_CLASSES - 1);
+}
 
 static int _nvmap_init_carveout(struct nvmap_carveout *co,
 	const char *name, unsigned long base_address, size_t len)
@@ -318,6 +379,7 @@ static int _nvmap_init_carveout(struct nvmap_carveout *co,
 		blocks[i].prev = i-1;
 		blocks[i].next_free = -1;
 		blocks[i].prev_free = -1;
+		blocks[i].free_class = -1;
 		blocks[i].co_heap = co;
 	}
 	blocks[i-1].next = -1;
@@ -335,7 +397,10 @@ static int _nvmap_init_carveout(struct nvmap_carveout *co,
 	spin_lock_init(&co->lock);
 	co->block_index = 0;
 	co->spare_index = 1;
-	co->free_index = 0;
+	for (i=0; i<NVMAP_FREE_CLASSES; i++)
+		co->free_index[i] = -1;
+	blocks[0].free_class = nvmap_free_class(len);
+	co->free_index[blocks[0].free_class] = 0;
 	return 0;
 
 fail:
@@ -355,11 +420,26 @@ static int nvmap_get_spare(struct nvmap_carveout *co) {
 	co->blocks[idx].prev = -1;
 	co->blocks[idx].next_free = -1;
 	co->blocks[idx].prev_free = -1;
+	co->blocks[idx].free_class = -1;
 	return idx;
 }
 
 #define BLOCK(_co, _idx) ((_idx)==-1 ? NULL : &(_co)->blocks[(_idx)])
 
+/* adds a block to the head of the free list for its current size */
+static void nvmap_insert_free(struct nvmap_carveout *co, int idx)
+{
+	struct nvmap_mem_block *block = BLOCK(co, idx);
+	int c = nvmap_free_class(block->size);
+
+	block->free_class = c;
+	block->prev_free = -1;
+	block->next_free = co->free_index[c];
+	if (co->free_index[c] != -1)
+		co->blocks[co->free_index[c]].prev_free = idx;
+	co->free_index[c] = idx;
+}
+
 static void nvmap_zap_free(struct nvmap_carveout *co, int idx)
 {
 	struct nvmap_mem_block *block;
@@ -368,13 +448,36 @@ static void nvmap_zap_free(struct nvmap_carveout *co, int idx)
 	if (block->prev_free != -1)
 		BLOCK(co, block->prev_free)->next_free = block->next_free;
 	else
-		co->free_index = block->next_free;
+		co->free_index[block->free_class] = block->next_free;
 
 	if (block->next_free != -1)
 		BLOCK(co, block->next_free)->prev_free = block->prev_free;
 
 	block->prev_free = -1;
 	block->next_free = -1;
+	block->free_class = -1;
+}
+
+/* returns the first free block, searching up from the size class of
+ * 'size', that can hold 'size' bytes at 'align', or -1 */
+static int nvmap_find_free(struct nvmap_carveout *co, size_t size,
+	size_t align)
+{
+	int c;
+
+	for (c = nvmap_free_class(size); c < NVMAP_FREE_CLASSES; c++) {
+		int idx = co->free_index[c];
+
+		while (idx != -1) {
+			struct nvmap_mem_block *b = BLOCK(co, idx);
+			size_t ljust = (b->base + align - 1) & ~(align-1);
+
+			if (b->base + b->size >= ljust + size)
+				return idx;
+			idx = b->next_free;
+		}
+	}
+	return -1;
 }
 
 static int nvmap_split_block(struct nvmap_carveout *co,
@@ -400,11 +503,7 @@ static int nvmap_split_block(struct nvmap_carveout *co,
 				co->blocks[spare->prev].next = spare_idx;
 			else
 				co->block_index = spare_idx;
-			spare->prev_free = -1;
-			spare->next_free = co->free_index;
-			if (co->free_index != -1)
-				co->blocks[co->free_index].prev_free = spare_idx;
-			co->free_index = spare_idx;
+			nvmap_insert_free(co, spare_idx);
 		} else {
 			/* not being able to split is fatal here, because we
 			 * need to realign block->base */
@@ -427,11 +526,7 @@ static int nvmap_split_block(struct nvmap_carveout *co,
 			block->next = spare_idx;
 			if (spare->next != -1)
 				co->blocks[spare->next].prev = spare_idx;
-			spare->prev_free = -1;
-			spare->next_free = co->free_index;
-			if (co->free_index != -1)
-				co->blocks[co->free_index].prev_free = spare_idx;
-			co->free_index = spare_idx;
+			nvmap_insert_free(co, spare_idx);
 		}
 	}
 
@@ -507,7 +602,7 @@ static void nvmap_carveout_free(struct nvmap_carveout *co, int idx, bool lock)
 		nvmap_insert_block(spare, co, zap);
 	}
 
-	nvmap_insert_block(free, co, idx);
+	nvmap_insert_free(co, idx);
 	if (lock) spin_unlock(&co->lock);
 }
 
@@ -523,8 +618,20 @@ static int nvmap_carveout_alloc_locked(struct nvmap_carveout_node *n,
 	int idx;
 
 	/* if idx_last is passed in as not -1, we'd want bottom_up
-	 * allocation */
-	idx = (idx_last != -1) ? co->block_index : co->free_index;
+	 * allocation; otherwise take the segregated-fit block */
+	if (idx_last == -1) {
+		idx = nvmap_find_free(co, size, align);
+		if (idx != -1) {
+			struct nvmap_mem_block *b = BLOCK(co, idx);
+			size_t ljust = (b->base + align - 1) & ~(align-1);
+
+			if (nvmap_split_block(co, idx, ljust, size, align))
+				idx = -1;
+		}
+		goto out;
+	}
+
+	idx = co->block_index;
 
 	while (idx != -1) {
 		size_t ljust;
@@ -549,9 +656,10 @@ static int nvmap_carveout_alloc_locked(struct nvmap_carveout_node *n,
 			return -1;
 		}
 
-		idx = (idx_last != -1) ? b->next : b->next_free;
+		idx = b->next;
 	}
 
+out:
 #if NVMAP_DEBUG_FS
 	if (idx != -1)  {
 		nvmap_add_debug_fs_node(n, co, idx);
@@ -923,10 +1031,12 @@ static void nvmap_add_debug_fs_node(struct nvmap_carveout_node *n,
 static struct device *__nvmap_heap_parent_dev(void);
 #define _nvmap_heap_parent_dev __nvmap_heap_parent_dev()
 
-/* unpinned I/O VMM areas may be reclaimed by nvmap to make room for
+/* unpinned I/O VMM areas stay mapped until nvmap needs the room for
  * new surfaces. unpinned surfaces are stored in segregated linked-lists
- * sorted in most-recently-unpinned order (i.e., head insertion, head
- * removal */
+ * sorted in least-recently-unpinned order (i.e., tail insertion, head
+ * removal), so that reclaim takes the coldest area first and prefers one
+ * from the requesting handle's own size bin, which can be reused without
+ * an IOVMM free and re-allocation */
 #ifdef CONFIG_DEVNVMAP_RECLAIM_UNPINNED_VM
 static DEFINE_SPINLOCK(nvmap_mru_vma_lock);
 static const size_t nvmap_mru_cutoff[] = {
@@ -1034,7 +1144,8 @@ static struct nvmap_handle *_nvmap_validate_get(unsigned long handle, bool su)
 static inline void _nvmap_insert_mru_vma(struct nvmap_handle *h)
 {
 #ifdef CONFIG_DEVNVMAP_RECLAIM_UNPINNED_VM
-	list_add(&h->pgalloc.mru_list, _nvmap_list(h->pgalloc.area->iovm_length));
+	list_add_tail(&h->pgalloc.mru_list,
+		_nvmap_list(h->pgalloc.area->iovm_length));
 #endif
 }
 
@@ -1068,9 +1179,11 @@ static struct tegra_iovmm_area *_nvmap_get_vm(struct nvmap_handle *h)
 		list_del(&h->pgalloc.mru_list);
 		INIT_LIST_HEAD(&h->pgalloc.mru_list);
 		spin_unlock(&nvmap_mru_vma_lock);
+		nvmap_pin_hits++;
 		return h->pgalloc.area;
 	}
 
+	nvmap_pin_misses++;
 	vm = tegra_iovmm_create_vm(nvmap_vm_client, NULL, h->size,
 		_nvmap_flag_to_pgprot(h->flags, pgprot_kernel));
 
@@ -1094,6 +1207,7 @@ static struct tegra_iovmm_area *_nvmap_get_vm(struct nvmap_handle *h)
 		evict->pgalloc.area = NULL;
 		INIT_LIST_HEAD(&evict->pgalloc.mru_list);
 		spin_unlock(&nvmap_mru_vma_lock);
+		nvmap_pin_evictions++;
 		return vm;
 	}
 
@@ -1104,6 +1218,8 @@ static struct tegra_iovmm_area *_nvmap_get_vm(struct nvmap_handle *h)
 			idx -= ARRAY_SIZE(nvmap_mru_vma_lists);
 		mru = &nvmap_mru_vma_lists[idx];
 		while (!list_empty(mru) && !vm) {
+			struct tegra_iovmm_area *area;
+
 			evict = list_first_entry(mru, struct nvmap_handle,
 				pgalloc.mru_list);
 
@@ -1111,9 +1227,13 @@ static struct tegra_iovmm_area *_nvmap_get_vm(struct nvmap_handle *h)
 			BUG_ON(!evict->pgalloc.area);
 			list_del(&evict->pgalloc.mru_list);
 			INIT_LIST_HEAD(&evict->pgalloc.mru_list);
-			spin_unlock(&nvmap_mru_vma_lock);
-			tegra_iovmm_free_vm(evict->pgalloc.area);
+			/* clear the area before dropping the lock, so that
+			 * _nvmap_handle_pin_resident can not pick it up */
+			area = evict->pgalloc.area;
 			evict->pgalloc.area = NULL;
+			spin_unlock(&nvmap_mru_vma_lock);
+			tegra_iovmm_free_vm(area);
+			nvmap_pin_evictions++;
 			vm = tegra_iovmm_create_vm(nvmap_vm_client,
 				NULL, h->size,
 				_nvmap_flag_to_pgprot(h->flags, pgprot_kernel));
@@ -1126,7 +1246,149 @@ static struct tegra_iovmm_area *_nvmap_get_vm(struct nvmap_handle *h)
 }
 
 static int _nvmap_do_cache_maint(struct nvmap_handle *h,
-	unsigned long start, unsigned long end, unsigned long op, bool get);
+	unsigned long start, unsigned long end, unsigned long op, bool get,
+	bool whole);
+
+#define nvmap_gfp (GFP_KERNEL | __GFP_HIGHMEM | __GFP_NOWARN)
+
+/* page pool for heap_pgalloc handles
+ *
+ * pages released by freed handles are queued as dirty and a worker zeroes
+ * them and writes them out of the inner and outer caches before moving
+ * them to the clean list, topping the pool up from the page allocator as
+ * it goes. allocations take clean pages in one batch and skip the
+ * per-page flush for them. the pool is given back under memory pressure
+ * by nvmap_page_pool_shrink. */
+static unsigned int nvmap_page_pool_size = 256;
+module_param_named(page_pool_size, nvmap_page_pool_size, uint, 0644);
+
+static DEFINE_SPINLOCK(nvmap_page_pool_lock);
+static LIST_HEAD(nvmap_page_pool_clean);
+static LIST_HEAD(nvmap_page_pool_dirty);
+static unsigned int nvmap_page_pool_nr_clean;
+static unsigned int nvmap_page_pool_nr_dirty;
+
+static void nvmap_page_pool_work_fn(struct work_struct *work);
+static DECLARE_WORK(nvmap_page_pool_work, nvmap_page_pool_work_fn);
+
+static void nvmap_flush_page(struct page *page, bool zero)
+{
+	void *km = kmap(page);
+	if (km) {
+		if (zero) clear_page(km);
+		__cpuc_flush_dcache_area(km, PAGE_SIZE);
+	}
+	outer_flush_range(page_to_phys(page),
+		page_to_phys(page)+PAGE_SIZE);
+	kunmap(page);
+}
+
+static void nvmap_page_pool_work_fn(struct work_struct *work)
+{
+	struct page *page;
+
+	for (;;) {
+		spin_lock(&nvmap_page_pool_lock);
+		if (list_empty(&nvmap_page_pool_dirty)) {
+			spin_unlock(&nvmap_page_pool_lock);
+			break;
+		}
+		page = list_first_entry(&nvmap_page_pool_dirty,
+			struct page, lru);
+		list_del(&page->lru);
+		nvmap_page_pool_nr_dirty--;
+		spin_unlock(&nvmap_page_pool_lock);
+
+		nvmap_flush_page(page, true);
+
+		spin_lock(&nvmap_page_pool_lock);
+		list_add_tail(&page->lru, &nvmap_page_pool_clean);
+		nvmap_page_pool_nr_clean++;
+		spin_unlock(&nvmap_page_pool_lock);
+	}
+
+	while (nvmap_page_pool_nr_clean < nvmap_page_pool_size) {
+		page = alloc_page(nvmap_gfp | __GFP_NORETRY);
+		if (!page) break;
+		nvmap_flush_page(page, true);
+
+		spin_lock(&nvmap_page_pool_lock);
+		if (nvmap_page_pool_nr_clean + nvmap_page_pool_nr_dirty >=
+		    nvmap_page_pool_size) {
+			spin_unlock(&nvmap_page_pool_lock);
+			__free_page(page);
+			break;
+		}
+		list_add_tail(&page->lru, &nvmap_page_pool_clean);
+		nvmap_page_pool_nr_clean++;
+		spin_unlock(&nvmap_page_pool_lock);
+	}
+}
+
+/* takes up to cnt clean pages from the pool; returns how many */
+static unsigned int nvmap_page_pool_alloc(struct page **pages,
+	unsigned int cnt)
+{
+	unsigned int i = 0;
+
+	spin_lock(&nvmap_page_pool_lock);
+	while (i<cnt && !list_empty(&nvmap_page_pool_clean)) {
+		pages[i] = list_first_entry(&nvmap_page_pool_clean,
+			struct page, lru);
+		list_del(&pages[i]->lru);
+		i++;
+	}
+	nvmap_page_pool_nr_clean -= i;
+	if (nvmap_page_pool_nr_clean < nvmap_page_pool_size/2)
+		schedule_work(&nvmap_page_pool_work);
+	spin_unlock(&nvmap_page_pool_lock);
+	return i;
+}
+
+/* returns a page to the pool, or to the system when the pool is full or
+ * someone else still holds a reference to the page */
+static void nvmap_page_pool_free(struct page *page)
+{
+	spin_lock(&nvmap_page_pool_lock);
+	if (page_count(page)==1 &&
+	    nvmap_page_pool_nr_clean + nvmap_page_pool_nr_dirty <
+	    nvmap_page_pool_size) {
+		list_add_tail(&page->lru, &nvmap_page_pool_dirty);
+		nvmap_page_pool_nr_dirty++;
+		page = NULL;
+	}
+	spin_unlock(&nvmap_page_pool_lock);
+	if (page) __free_page(page);
+}
+
+static int nvmap_page_pool_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct page *page;
+
+	spin_lock(&nvmap_page_pool_lock);
+	while (nr_to_scan-- > 0) {
+		if (!list_empty(&nvmap_page_pool_dirty)) {
+			page = list_first_entry(&nvmap_page_pool_dirty,
+				struct page, lru);
+			nvmap_page_pool_nr_dirty--;
+		} else if (!list_empty(&nvmap_page_pool_clean)) {
+			page = list_first_entry(&nvmap_page_pool_clean,
+				struct page, lru);
+			nvmap_page_pool_nr_clean--;
+		} else
+			break;
+		list_del(&page->lru);
+		__free_page(page);
+	}
+	nr_to_scan = nvmap_page_pool_nr_clean + nvmap_page_pool_nr_dirty;
+	spin_unlock(&nvmap_page_pool_lock);
+	return nr_to_scan;
+}
+
+static struct shrinker nvmap_page_pool_shrinker = {
+	.shrink = nvmap_page_pool_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
 
 void _nvmap_handle_free(struct nvmap_handle *h)
 {
@@ -1165,7 +1427,7 @@ void _nvmap_handle_free(struct nvmap_handle *h)
 	/* ensure that no stale data remains in the cache for this handle */
 	if (h->alloc)
 		e = _nvmap_do_cache_maint(h, 0, h->size,
-			NVMEM_CACHE_OP_WB_INV, false);
+			NVMEM_CACHE_OP_WB_INV, false, false);
 
 	if (h->alloc && !h->heap_pgalloc) {
 		struct nvmap_carveout *co = h->carveout.co_heap;
@@ -1206,8 +1468,9 @@ void _nvmap_handle_free(struct nvmap_handle *h)
 		if (h->pgalloc.area) tegra_iovmm_free_vm(h->pgalloc.area);
 		for (i=0; i<h->size>>PAGE_SHIFT; i++) {
 			ClearPageReserved(h->pgalloc.pages[i]);
-			__free_page(h->pgalloc.pages[i]);
+			nvmap_page_pool_free(h->pgalloc.pages[i]);
 		}
+		schedule_work(&nvmap_page_pool_work);
 		if ((h->size>>PAGE_SHIFT)*sizeof(struct page*)>=PAGE_SIZE)
 			vfree(h->pgalloc.pages);
 		else
@@ -1217,8 +1480,6 @@ void _nvmap_handle_free(struct nvmap_handle *h)
 	kfree(h);
 }
 
-#define nvmap_gfp (GFP_KERNEL | __GFP_HIGHMEM | __GFP_NOWARN)
-
 /* map the backing pages for a heap_pgalloc handle into its IOVMM area */
 static void _nvmap_handle_iovmm_map(struct nvmap_handle *h)
 {
@@ -1242,6 +1503,7 @@ static void _nvmap_handle_iovmm_map(struct nvmap_handle *h)
 static int nvmap_pagealloc(struct nvmap_handle *h, bool contiguous)
 {
 	unsigned int i = 0, cnt = (h->size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	unsigned int pooled = 0;
 	struct page **pages;
 
 	if (cnt*sizeof(*pages)>=PAGE_SIZE)
@@ -1262,7 +1524,8 @@ static int nvmap_pagealloc(struct nvmap_handle *h, bool contiguous)
 		for (; i<(1<<order); i++)
 			__free_page(nth_page(compound_page, i));
 	} else {
-		for (i=0; i<cnt; i++) {
+		pooled = nvmap_page_pool_alloc(pages, cnt);
+		for (i=pooled; i<cnt; i++) {
 			pages[i] = alloc_page(nvmap_gfp);
 			if (!pages[i]) {
 			    pr_err("failed to allocate %u pages after %u entries\n",
@@ -1283,14 +1546,10 @@ static int nvmap_pagealloc(struct nvmap_handle *h, bool contiguous)
 	}
 #endif
 
+	/* pages from the pool are already clean */
 	for (i=0; i<cnt; i++) {
-		void *km;
 		SetPageReserved(pages[i]);
-		km = kmap(pages[i]);
-		if (km) __cpuc_flush_dcache_area(km, PAGE_SIZE);
-		outer_flush_range(page_to_phys(pages[i]),
-			page_to_phys(pages[i])+PAGE_SIZE);
-		kunmap(pages[i]);
+		if (i >= pooled) nvmap_flush_page(pages[i], false);
 	}
 
 	h->size = cnt<<PAGE_SHIFT;
@@ -1656,6 +1915,81 @@ static int _nvmap_handle_unpin(struct nvmap_handle *h)
 	return ret;
 }
 
+/* pins a handle if that can be done without allocating IOVMM space:
+ * carveout and contiguous handles, and IOVMM handles whose area is still
+ * resident. the area is taken off the MRU lists under nvmap_mru_vma_lock,
+ * which is also held by anyone evicting it, so nvmap_pin_lock is not
+ * needed. returns false if the handle must go through the locked path */
+static bool _nvmap_handle_pin_resident(struct nvmap_handle *h)
+{
+#ifdef CONFIG_DEVNVMAP_RECLAIM_UNPINNED_VM
+	if (h->heap_pgalloc && !h->pgalloc.contig) {
+		bool resident = false;
+
+		spin_lock(&nvmap_mru_vma_lock);
+		if (h->pgalloc.area && _nvmap_handle_get(h)) {
+			if (atomic_inc_return(&h->pin)==1) {
+				list_del(&h->pgalloc.mru_list);
+				INIT_LIST_HEAD(&h->pgalloc.mru_list);
+			}
+			resident = true;
+		}
+		spin_unlock(&nvmap_mru_vma_lock);
+		if (resident) nvmap_pin_hits++;
+		return resident;
+	}
+#endif
+	return !_nvmap_handle_pin_locked(h);
+}
+
+/* pins h under nvmap_pin_lock, sleeping until IOVMM room is available */
+static int _nvmap_handle_pin_wait(struct nvmap_handle *h)
+{
+	ktime_t start;
+	int ret;
+
+	if (!_nvmap_handle_pin_locked(h)) return 0;
+
+	nvmap_pin_waits++;
+	start = ktime_get();
+	ret = wait_event_interruptible(nvmap_pin_wait,
+		!_nvmap_handle_pin_locked(h));
+	nvmap_pin_wait_us += ktime_to_us(ktime_sub(ktime_get(), start));
+	return ret;
+}
+
+/* pins nr handles in order; *pinned is set to the number actually pinned,
+ * which the caller must unwind on error. nvmap_pin_lock is only taken
+ * if a handle needs an IOVMM area allocated. in that case the resident
+ * prefix is dropped first and the whole array pinned under the lock: a
+ * stream sleeping in _nvmap_handle_pin_wait may be waiting for exactly
+ * the space those pins hold, and they could not be released while this
+ * stream blocks on the lock */
+static int _nvmap_pin_array(unsigned int nr, struct nvmap_handle **h,
+	unsigned int *pinned)
+{
+	unsigned int i = 0;
+	int ret = 0;
+
+	while (i<nr && _nvmap_handle_pin_resident(h[i])) i++;
+
+	if (i<nr) {
+		if (i) {
+			int do_wake = 0;
+			while (i--) do_wake |= _nvmap_handle_unpin(h[i]);
+			if (do_wake) wake_up(&nvmap_pin_wait);
+			i = 0;
+			nvmap_pin_restarts++;
+		}
+		mutex_lock(&nvmap_pin_lock);
+		while (i<nr && !(ret = _nvmap_handle_pin_wait(h[i]))) i++;
+		mutex_unlock(&nvmap_pin_lock);
+	}
+
+	*pinned = i;
+	return ret;
+}
+
 /* pin a list of handles, mapping IOVMM areas if needed. may sleep, if
  * a handle's IOVMM area has been reclaimed and insufficient IOVMM space
  * is available to complete the list pin. no intervening pin operations
@@ -1671,12 +2005,7 @@ static int _nvmap_handle_pin_fast(unsigned int nr, struct nvmap_handle **h)
 		return -EINVAL;
 	}
 
-	mutex_lock(&nvmap_pin_lock);
-	for (i=0; i<nr && !ret; i++) {
-		ret = wait_event_interruptible(nvmap_pin_wait,
-			!_nvmap_handle_pin_locked(h[i]));
-	}
-	mutex_unlock(&nvmap_pin_lock);
+	ret = _nvmap_pin_array(nr, h, &i);
 
 	if (ret) {
 		int do_wake = 0;
@@ -1792,19 +2121,17 @@ static int _nvmap_do_pin(struct nvmap_file_priv *priv,
 
 	if (ret) return ret;
 
-	mutex_lock(&nvmap_pin_lock);
-	for (i=0; i<nr && !ret; i++) {
-		ret = wait_event_interruptible(nvmap_pin_wait,
-			!_nvmap_handle_pin_locked(h[i]));
-	}
-	mutex_unlock(&nvmap_pin_lock);
+	ret = _nvmap_pin_array(nr, h, &i);
 
 	if (ret) {
 		int do_wake = 0;
+		unsigned int pinned = i;
+
 		spin_lock(&priv->ref_lock);
-		while (i--) {
+		for (i=0; i<nr; i++) {
 			r = _nvmap_ref_lookup_locked(priv, refs[i]);
-			do_wake |= _nvmap_handle_unpin(r->h);
+			if (i < pinned)
+				do_wake |= _nvmap_handle_unpin(h[i]);
 			if (r) atomic_dec(&r->pin);
 		}
 		spin_unlock(&priv->ref_lock);
@@ -1934,8 +2261,11 @@ static int nvmap_open(struct inode *inode, struct file *filp)
 		mutex_lock(&nvmap_pin_lock);
 		if (!nvmap_vm_client) {
 			nvmap_vm_client = tegra_iovmm_alloc_client("gpu", NULL);
-			if (nvmap_vm_client)
+			if (nvmap_vm_client) {
+				tegra_iovmm_client_set_quota(nvmap_vm_client,
+					nvmap_iovmm_quota);
 				tegra_iovmm_client_lock(nvmap_vm_client);
+			}
 		}
 		mutex_unlock(&nvmap_pin_lock);
 	}
@@ -2185,7 +2515,7 @@ static bool _nvmap_carveout_do_compact(struct nvmap_handle *h,
 			spin_lock(&co->lock);
 			idx = co->block_index;
 			while (idx!=-1 && nrelocate <= NVMAP_NRELOCATE_LIMIT) {
-				if (BLOCK(co, co->free_index)->size >= h->size) {
+				if (nvmap_find_free(co, h->size, align) != -1) {
 					compaction_success = true;
 					if (compact_minimal) {
 						break;
@@ -2807,10 +3137,31 @@ static int nvmap_mmap(struct file *filp, struct vm_area_struct *vma)
 	return 0;
 }
 
+/* explicit write-backs and flushes (the cache-maint ioctl and
+ * NvRmMemCacheMaint) of at least this many bytes clean the whole inner
+ * cache on every CPU rather than walking the range through the nvmap PTE
+ * window; the outer cache is still maintained by physical range. the
+ * default is twice the 32K L1 D-cache, so the IPI is only paid when the
+ * range walk would touch more lines than the cache holds. invalidates
+ * always go by range, since cleaning unrelated dirty lines is harmless
+ * but a set/way flush would also write back this range's stale lines
+ * over data a device has just written. handle frees always go by range,
+ * so releasing a large buffer does not interrupt every CPU. */
+static unsigned int nvmap_cache_maint_threshold = SZ_64K;
+module_param_named(cache_maint_threshold, nvmap_cache_maint_threshold,
+	uint, 0644);
+
+static void nvmap_flush_inner_all(void *unused)
+{
+	__cpuc_flush_kern_all();
+}
+
 /* perform cache maintenance on a handle; caller's handle must be pre-
- * validated. */
+ * validated. whole allows large requests to flush the entire inner cache,
+ * see nvmap_cache_maint_threshold. */
 static int _nvmap_do_cache_maint(struct nvmap_handle *h,
-	unsigned long start, unsigned long end, unsigned long op, bool get)
+	unsigned long start, unsigned long end, unsigned long op, bool get,
+	bool whole)
 {
 	pgprot_t prot;
 	void *addr = NULL;
@@ -2849,6 +3200,14 @@ static int _nvmap_do_cache_maint(struct nvmap_handle *h,
 
 	prot = _nvmap_flag_to_pgprot(h->flags, pgprot_kernel);
 
+	if (whole && op != NVMEM_CACHE_OP_INV &&
+	    end - start >= nvmap_cache_maint_threshold) {
+		on_each_cpu(nvmap_flush_inner_all, NULL, 1);
+		inner_maint = NULL;
+		if (!outer_maint)
+			goto out;
+	}
+
 	if (h->alloc && !h->heap_pgalloc) {
 		spin_lock(&h->carveout.co_heap->lock);
 		BLOCK(h->carveout.co_heap, h->carveout.block_idx)->mapcount++;
@@ -2870,21 +3229,24 @@ static int _nvmap_do_cache_maint(struct nvmap_handle *h,
 			phys = h->carveout.base + start;
 		}
 
-		if (!addr) {
-			err = nvmap_map_pte(__phys_to_pfn(phys), prot, &addr);
-			if (err) {
-				if (page) put_page(page);
-				break;
-			}
-		} else {
-			_nvmap_set_pte_at((unsigned long)addr,
-				__phys_to_pfn(phys), prot);
-		}
-
-		src = addr + (phys & ~PAGE_MASK);
 		count = min_t(size_t, end-start, PAGE_SIZE-(phys&~PAGE_MASK));
 
-		inner_maint(src, src+count);
+		if (inner_maint) {
+			if (!addr) {
+				err = nvmap_map_pte(__phys_to_pfn(phys), prot,
+					&addr);
+				if (err) {
+					if (page) put_page(page);
+					break;
+				}
+			} else {
+				_nvmap_set_pte_at((unsigned long)addr,
+					__phys_to_pfn(phys), prot);
+			}
+
+			src = addr + (phys & ~PAGE_MASK);
+			inner_maint(src, src+count);
+		}
 		if (outer_maint) outer_maint(phys, phys+count);
 		start += count;
 		if (page) put_page(page);
@@ -2932,7 +3294,7 @@ static int nvmap_ioctl_cache_maint(struct file *filp, void __user *arg)
 	start = (unsigned long)op.addr - vma->vm_start;
 	end  = start + op.len;
 
-	return _nvmap_do_cache_maint(vpriv->h, start, end, op.op, true);
+	return _nvmap_do_cache_maint(vpriv->h, start, end, op.op, true, true);
 }
 
 /* copies a single element from the pre-get()'ed handle h, returns
@@ -3035,7 +3397,7 @@ static ssize_t _nvmap_do_rw_handle(struct nvmap_handle *h, int is_read,
 		size_t ret;
 		if (is_read)
 			_nvmap_do_cache_maint(h, h_offs, h_offs + elem_size,
-					NVMEM_CACHE_OP_INV, false);
+					NVMEM_CACHE_OP_INV, false, false);
 		ret = _nvmap_do_one_rw_handle(h, is_read,
 			is_user, h_offs, sys_addr, elem_size, &addr);
 		if (ret < 0) {
@@ -3044,7 +3406,7 @@ static ssize_t _nvmap_do_rw_handle(struct nvmap_handle *h, int is_read,
 		}
 		if (!is_read)
 			_nvmap_do_cache_maint(h, h_offs, h_offs + ret,
-					NVMEM_CACHE_OP_WB, false);
+					NVMEM_CACHE_OP_WB, false, false);
 		bytes_copied += ret;
 		if (ret < elem_size) break;
 		sys_addr += sys_stride;
@@ -3239,6 +3601,8 @@ static int __init nvmap_dev_init(void)
 	}
 	up_read(&nvmap_context.list_sem);
 
+	register_shrinker(&nvmap_page_pool_shrinker);
+
 	nvmap_procfs_root = proc_mkdir("nvmap", NULL);
 	if (nvmap_procfs_root) {
 		nvmap_procfs_proc = proc_mkdir("proc", nvmap_procfs_root);
@@ -3339,6 +3703,7 @@ static int _nvmap_try_create_preserved(struct nvmap_carveout_node *n,
 {
 	unsigned long end = base + size;
 	short idx;
+	int c;
 	struct nvmap_carveout *co = &n->carveout;
 
 	h->carveout.base = ~0;
@@ -3346,12 +3711,13 @@ static int _nvmap_try_create_preserved(struct nvmap_carveout_node *n,
 	h->carveout.co_heap = NULL;
 
 	spin_lock(&co->lock);
-	idx = co->free_index;
-	while (idx != -1) {
-		struct nvmap_mem_block *b = BLOCK(co, idx);
-		unsigned long blk_end = b->base + b->size;
-		if (b->base <= base && blk_end >= end) {
-			if (!nvmap_split_block(co, idx, base, size, 1)) {
+	for (c = nvmap_free_class(size); c < NVMAP_FREE_CLASSES; c++) {
+		idx = co->free_index[c];
+		while (idx != -1) {
+			struct nvmap_mem_block *b = BLOCK(co, idx);
+			unsigned long blk_end = b->base + b->size;
+			if (b->base <= base && blk_end >= end &&
+			    !nvmap_split_block(co, idx, base, size, 1)) {
 				h->carveout.block_idx = idx;
 				h->carveout.base = co->blocks[idx].base;
 				co->blocks[idx].h = NULL;
@@ -3360,11 +3726,12 @@ static int _nvmap_try_create_preserved(struct nvmap_carveout_node *n,
 #if NVMAP_DEBUG_FS
 				nvmap_add_debug_fs_node(n, co, idx);
 #endif
-				break;
+				goto out;
 			}
+			idx = b->next_free;
 		}
-		idx = b->next_free;
 	}
+out:
 	spin_unlock(&co->lock);
 
 	return (h->carveout.co_heap == NULL) ? -ENXIO : 0;
@@ -3859,7 +4226,7 @@ void NvRmMemCacheMaint(NvRmMemHandle hMem, void *pMapping,
 
 	start = (unsigned long)pMapping - (unsigned long)h->kern_map;
 
-	_nvmap_do_cache_maint(h, start, start+Size, op, true);
+	_nvmap_do_cache_maint(h, start, start+Size, op, true, true);
 	return;
 }
 
@@ -81,6 +81,18 @@ struct mmc_host_ops {
 	 */
 	int (*enable)(struct mmc_host *host);
 	int (*disable)(struct mmc_host *host, int lazy);
+	/*
+	 * 'pre_req' and 'post_req' are optional. 'pre_req' is called for a
+	 * request started with mmc_start_req() while the previous request
+	 * may still be running, so that the host can do its DMA mapping and
+	 * cache maintenance ahead of 'request'. 'is_first_req' is set when
+	 * nothing is in flight. 'post_req' undoes 'pre_req' once the request
+	 * has completed, or with a non-zero 'err' if it was never issued.
+	 */
+	void	(*pre_req)(struct mmc_host *host, struct mmc_request *req,
+			   bool is_first_req);
+	void	(*post_req)(struct mmc_host *host, struct mmc_request *req,
+			    int err);
 	void	(*request)(struct mmc_host *host, struct mmc_request *req);
 	/*
 	 * Avoid calling these three functions too often or in a "fast path",
@@ -186,6 +198,7 @@ struct mmc_host {
 	struct delayed_work	disable;	/* disabling work */
 
 	struct mmc_card		*card;		/* device attached to this host */
+	struct mmc_async_req	*areq;		/* active async request */
 
 	wait_queue_head_t	wq;
 	struct task_struct	*claimer;	/* task that has host claimed */
@@ -259,6 +259,7 @@ struct _mmc_csd {
 #define EXT_CSD_SEC_CNT		212	/* RO, 4 bytes */
 #define EXT_CSD_S_A_TIMEOUT	217
 #define EXT_CSD_BOOT_SIZE_MULTI 226
+#define EXT_CSD_MAX_PACKED_WRITES	500	/* RO */
 /*
  * EXT_CSD field definitions
  */
@@ -269,11 +270,21 @@ struct _mmc_csd {
 
 #define EXT_CSD_CARD_TYPE_26	(1<<0)	/* Card can run at 26MHz */
 #define EXT_CSD_CARD_TYPE_52	(1<<1)	/* Card can run at 52MHz */
+#define EXT_CSD_CARD_TYPE_MASK	0x3	/* Mask out unsupported modes */
 
 #define EXT_CSD_BUS_WIDTH_1	0	/* Card is in 1 bit mode */
 #define EXT_CSD_BUS_WIDTH_4	1	/* Card is in 4 bit mode */
 #define EXT_CSD_BUS_WIDTH_8	2	/* Card is in 8 bit mode */
 
+/*
+ * SET_BLOCK_COUNT argument and packed command header (v4.5)
+ */
+
+#define MMC_CMD23_ARG_PACKED	(1<<30)	/* Following CMD25 is packed */
+
+#define MMC_PACKED_CMD_VER	0x01
+#define MMC_PACKED_CMD_WR	0x02
+
 /*
  * MMC_SWITCH access modes
  */
@@ -33,6 +33,12 @@
 #define NVHOST_NO_TIMEOUT (-1)
 #define NVHOST_IOCTL_MAGIC 'H'
 
+/*
+ * A channel write starts with a submit header followed by its cmdbufs and
+ * relocs. Several header/cmdbuf/reloc sequences using the same syncpt may
+ * be written before NVHOST_IOCTL_CHANNEL_FLUSH; they are kicked off as one
+ * batch and the flush returns the syncpt value after the last of them.
+ */
 struct nvhost_submit_hdr {
 	__u32 syncpt_id;
 	__u32 syncpt_incrs;